@@ -23,6 +23,7 @@
 
 struct wl_buffer;
 struct gbm_bo;
+struct sync_timeline;
 
 enum buffer_type {
 	BUFFER_UNSPEC = 0,
@@ -40,7 +41,9 @@ struct buffer {
 	struct wl_buffer* wl_buffer;
 	bool is_attached;
 	bool please_clean_up;
-	struct pixman_region16 damage;
+	struct pixman_region32 damage;
+	// The last frame that was rendered into the buffer, or zero
+	uint64_t frame;
 
 	// wl_shm:
 	void* pixels;
@@ -48,8 +51,17 @@ struct buffer {
 
 	// dmabuf:
 	struct gbm_bo* bo;
+
+	/* Explicit sync: the compositor waits for the acquire point before
+	 * reading and signals the release point when it is done.
+	 */
+	struct sync_timeline* timeline;
+	uint64_t acquire_point, release_point;
 };
 
 struct buffer* buffer_create_shm(int width, int height, int stride, uint32_t format);
-struct buffer* buffer_create_dmabuf(int width, int height, uint32_t format);
+struct buffer* buffer_create_dmabuf(int width, int height, uint32_t format,
+		const uint64_t* modifiers, int n_modifiers, bool scanout);
 void buffer_destroy(struct buffer* self);
+void buffer_poll_release(struct buffer* self);
+bool buffer_is_release_available(const struct buffer* self);
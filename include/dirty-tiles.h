@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DIRTY_TILE_SIZE 64
+
+struct pixman_region32;
+
+/* Damage is tracked per tile while decoding, so marking a rectangle doesn't
+ * depend on how fragmented the damage already is. It is converted into a
+ * region once per frame.
+ */
+struct dirty_tiles {
+	int width, height;
+	int cols, rows;
+	uint8_t* map;
+
+	// Range of tile rows that may contain dirty tiles
+	int row_min, row_max;
+};
+
+int dirty_tiles_resize(struct dirty_tiles* self, int width, int height);
+void dirty_tiles_destroy(struct dirty_tiles* self);
+
+void dirty_tiles_mark(struct dirty_tiles* self, int x, int y, int width,
+		int height);
+void dirty_tiles_clear(struct dirty_tiles* self);
+bool dirty_tiles_is_empty(const struct dirty_tiles* self);
+bool dirty_tiles_intersects(const struct dirty_tiles* self, int x, int y,
+		int width, int height);
+
+void dirty_tiles_to_region(const struct dirty_tiles* self,
+		struct pixman_region32* dst);
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct wl_surface;
+struct zwp_linux_dmabuf_v1;
+struct zwp_linux_dmabuf_feedback_v1;
+
+// The number of formats that can be negotiated
+#define DMABUF_FEEDBACK_N_FORMATS 2
+
+/* Result of dmabuf feedback (linux-dmabuf v4). Tranches are sent in order of
+ * preference, so the first one that contains a supported format is used.
+ *
+ * Surface feedback is sent again whenever the preferences for the surface
+ * change, e.g. when it moves to another output. The result is replaced at
+ * the end of each round, after which on_done is called.
+ */
+struct dmabuf_feedback {
+	struct zwp_linux_dmabuf_feedback_v1* feedback;
+	bool is_done;
+
+	// Only this format is considered, unless it is DRM_FORMAT_INVALID
+	uint32_t required_format;
+
+	void (*on_done)(struct dmabuf_feedback* self, void* userdata);
+	void* userdata;
+
+	dev_t main_device;
+	bool have_main_device;
+
+	uint32_t format;
+	uint64_t* modifiers;
+	int n_modifiers;
+	bool is_scanout;
+
+	// State while receiving
+	void* table;
+	size_t table_size;
+	uint32_t tranche_flags;
+	uint64_t* tranche_modifiers[DMABUF_FEEDBACK_N_FORMATS];
+	int n_tranche_modifiers[DMABUF_FEEDBACK_N_FORMATS];
+	uint32_t pending_format;
+	uint64_t* pending_modifiers;
+	int n_pending_modifiers;
+	bool pending_is_scanout;
+};
+
+struct dmabuf_feedback* dmabuf_feedback_get_default(
+		struct zwp_linux_dmabuf_v1* dmabuf);
+struct dmabuf_feedback* dmabuf_feedback_get_surface(
+		struct zwp_linux_dmabuf_v1* dmabuf, struct wl_surface* surface,
+		uint32_t required_format);
+void dmabuf_feedback_destroy(struct dmabuf_feedback* self);
+
+int dmabuf_feedback_open_main_device(const struct dmabuf_feedback* self);
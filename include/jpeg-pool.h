@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* A JPEG image to be decoded on the work pool. The caller owns the job and the
+ * memory it points to until jpeg_pool_wait() returns, after which result is
+ * negative if decoding failed.
+ */
+struct jpeg_job {
+	uint8_t* data;
+	unsigned long length;
+	int width, height;
+
+	// Packed pixels are written to dst, or to planes if dst is NULL
+	uint8_t* dst;
+	int pitch, flags;
+	uint8_t** planes;
+	int* strides;
+
+	int result;
+};
+
+void jpeg_pool_finish(void);
+
+void jpeg_pool_submit(struct jpeg_job* job);
+void jpeg_pool_wait(void);
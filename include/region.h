@@ -16,9 +16,9 @@
 
 #pragma once
 
-struct pixman_region16;
+struct pixman_region32;
 
-void region_scale(struct pixman_region16* dst, struct pixman_region16* src,
+void region_scale(struct pixman_region32* dst, struct pixman_region32* src,
 		double scale);
-void region_translate(struct pixman_region16* dst, struct pixman_region16* src,
+void region_translate(struct pixman_region32* dst, struct pixman_region32* src,
 		int x, int y);
@@ -1,11 +1,16 @@
 #pragma once
 
+#include <stdbool.h>
+
 struct buffer;
 struct image;
 struct vnc_av_frame;
 
 int egl_init(void);
 void egl_finish(void);
+void egl_reset_textures(void);
+bool egl_has_native_fence_sync(void);
+void egl_set_upload_overdraw(double ratio);
 
 void render_image_egl(struct buffer* dst, const struct image* src, double scale,
 		int pos_x, int pos_y);
@@ -19,12 +19,40 @@
 #include <pixman.h>
 
 struct buffer;
+struct vnc_copy_rect;
+struct vnc_jpeg_rect;
 
 struct image {
 	int width, height, stride;
 	uint32_t format;
 	void* pixels;	
-	struct pixman_region16* damage;
+	struct pixman_region32* damage;
+
+	/* Copies within the image that happened before the damage was drawn.
+	 * Renderers that keep their own copy of the image may repeat them, or
+	 * treat their destinations as damage.
+	 */
+	const struct vnc_copy_rect* copy_rects;
+	int n_copy_rects;
+	struct pixman_region32* copy_damage;
+
+	/* JPEG rects that are only available as YUV planes within their stale
+	 * regions. Only renderers that can convert them are given any.
+	 */
+	struct vnc_jpeg_rect* const* yuv_rects;
+	int n_yuv_rects;
+
+	/* Where the pixels are out of date, because JPEG rects there have yet to
+	 * be decoded. Uploads must not cover any of it, or they would overwrite
+	 * what was converted from YUV before.
+	 */
+	struct pixman_region32* stale;
+
+	/* Decodes a YUV rect into the pixels on the CPU, for when it can't be
+	 * converted after all.
+	 */
+	void (*resolve_yuv_rect)(struct vnc_jpeg_rect* rect, void* userdata);
+	void* userdata;
 };
 
 void render_image(struct buffer* dst, const struct image* src, double scale,
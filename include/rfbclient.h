@@ -217,6 +217,11 @@ typedef void (*GotCopyRectProc)(struct _rfbClient* client, int src_x, int src_y,
 typedef void (*GotFillRectProc)(struct _rfbClient* client, int x, int y, int w, int h, uint32_t colour);
 typedef void (*GotBitmapProc)(struct _rfbClient* client, const uint8_t* buffer, int x, int y, int w, int h);
 typedef rfbBool (*GotJpegProc)(struct _rfbClient* client, const uint8_t* buffer, int length, int x, int y, int w, int h);
+/**
+   Callback indicating that the rectangle which is about to be reported through
+   GotFrameBufferUpdate was encoded lossily, e.g. as Tight JPEG.
+ */
+typedef void (*GotLossyRectProc)(struct _rfbClient* client, int x, int y, int w, int h);
 typedef rfbBool (*LockWriteToTLSProc)(struct _rfbClient* client);   /** @deprecated */
 typedef rfbBool (*UnlockWriteToTLSProc)(struct _rfbClient* client); /** @deprecated */
 
@@ -303,7 +308,8 @@ typedef struct _rfbClient {
 	rfbBool cutZeros;
 	int rectWidth, rectColors;
 	char tightPalette[256*4];
-	uint8_t tightPrevRow[2048*3*sizeof(uint16_t)];
+	uint8_t* tightPrevRow;
+	size_t tightPrevRowSize;
 
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
 	/** JPEG decoder state (obsolete-- do not use). */
@@ -467,6 +473,21 @@ typedef struct _rfbClient {
 
 	StartingFrameBufferUpdateProc StartingFrameBufferUpdate;
 	CancelledFrameBufferUpdateProc CancelledFrameBufferUpdate;
+	GotLossyRectProc GotLossyRect;
+
+	/**
+	 * If greater than 1, frameBuffer holds the desktop reduced by this
+	 * factor in each dimension. Decoders then hand full-resolution pixels
+	 * to GotBitmap, GotFillRect and GotCopyRect, which must downsample,
+	 * except for Tight JPEG which is decoded directly at reduced size.
+	 */
+	int frameBufferDownscale;
+	/** Full-resolution scratch rows for decoders. For internal use only. */
+	uint8_t* stagingBuffer;
+	size_t stagingBufferSize;
+
+	/** While set, no framebuffer update requests are sent. */
+	rfbBool updatesPaused;
 } rfbClient;
 
 /* cursor.c */
@@ -510,6 +531,14 @@ extern rfbBool InitialiseRFBConnection(rfbClient* client);
  * false otherwise
  */
 extern rfbBool SetFormatAndEncodings(rfbClient* client);
+/**
+ * Sends only the encoding parameters to the server, leaving the pixel format
+ * untouched. Use this to switch encodings or quality levels mid-session.
+ * @param client The client in which the encodings have been changed
+ * @return true if the encodings were sent to the server successfully,
+ * false otherwise
+ */
+extern rfbBool SendEncodings(rfbClient* client);
 extern rfbBool SendIncrementalFramebufferUpdateRequest(rfbClient* client);
 /**
  * Sends a framebuffer update request to the server. A VNC client may request an
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct wp_linux_drm_syncobj_manager_v1;
+struct wp_linux_drm_syncobj_timeline_v1;
+
+/* A DRM syncobj timeline that is shared with the compositor. Each buffer has
+ * its own, because the compositor may signal release points out of order.
+ */
+struct sync_timeline {
+	int drm_fd;
+	uint32_t handle;
+	// Binary syncobj for moving fences between sync files and points
+	uint32_t staging;
+	struct wp_linux_drm_syncobj_timeline_v1* wl_timeline;
+	uint64_t point;
+};
+
+struct sync_timeline* sync_timeline_create(int drm_fd,
+		struct wp_linux_drm_syncobj_manager_v1* manager);
+void sync_timeline_destroy(struct sync_timeline* self);
+
+uint64_t sync_timeline_next_point(struct sync_timeline* self);
+bool sync_timeline_is_signalled(struct sync_timeline* self, uint64_t point);
+bool sync_timeline_is_available(struct sync_timeline* self, uint64_t point);
+int sync_timeline_signal(struct sync_timeline* self, uint64_t point);
+
+int sync_timeline_import_sync_file(struct sync_timeline* self, uint64_t point,
+		int fd);
+int sync_timeline_export_sync_file(struct sync_timeline* self, uint64_t point,
+		int timeout_ms);
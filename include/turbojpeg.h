@@ -473,6 +473,61 @@ DLLEXPORT int DLLCALL tjDecompress2(tjhandle handle,
   int width, int pitch, int height, int pixelFormat, int flags);
 
 
+/**
+ * The plane width of a YUV image plane with the given parameters.
+ *
+ * @param componentID ID number of the image plane (0 = Y, 1 = U/Cb, 2 = V/Cr)
+ * @param width width (in pixels) of the YUV image
+ * @param subsamp level of chrominance subsampling in the image (see
+ *        @ref TJSAMP "Chrominance subsampling options".)
+ *
+ * @return the plane width of a YUV image plane with the given parameters, or
+ *         -1 if the arguments are out of bounds.
+ */
+DLLEXPORT int DLLCALL tjPlaneWidth(int componentID, int width, int subsamp);
+
+
+/**
+ * The plane height of a YUV image plane with the given parameters.
+ *
+ * @param componentID ID number of the image plane (0 = Y, 1 = U/Cb, 2 = V/Cr)
+ * @param height height (in pixels) of the YUV image
+ * @param subsamp level of chrominance subsampling in the image (see
+ *        @ref TJSAMP "Chrominance subsampling options".)
+ *
+ * @return the plane height of a YUV image plane with the given parameters, or
+ *         -1 if the arguments are out of bounds.
+ */
+DLLEXPORT int DLLCALL tjPlaneHeight(int componentID, int height, int subsamp);
+
+
+/**
+ * Decompress a YCbCr JPEG image into separate Y, U (Cb), and V (Cr) image
+ * planes.  This skips color conversion and chrominance upsampling, which are
+ * left to the caller.
+ *
+ * @param handle a handle to a TurboJPEG decompressor or transformer instance
+ * @param jpegBuf pointer to a buffer containing the JPEG image to decompress
+ * @param jpegSize size of the JPEG image (in bytes)
+ * @param dstPlanes an array of pointers to Y, U (Cb), and V (Cr) image planes
+ *        (or just a Y plane, if decompressing a grayscale image.)  Each plane
+ *        must be at least <tt>strides[i] * #tjPlaneHeight()</tt> bytes.
+ * @param width width (in pixels) of the JPEG image, or 0.  Scaling is not
+ *        supported.
+ * @param strides an array of integers, each specifying the number of bytes
+ *        per line in the corresponding plane, or NULL to use the plane
+ *        widths.
+ * @param height height (in pixels) of the JPEG image, or 0.
+ * @param flags the bitwise OR of one or more of the @ref TJFLAG_BOTTOMUP
+ *        "flags" (currently unused.)
+ *
+ * @return 0 if successful, or -1 if an error occurred (see #tjGetErrorStr().)
+ */
+DLLEXPORT int DLLCALL tjDecompressToYUVPlanes(tjhandle handle,
+  unsigned char *jpegBuf, unsigned long jpegSize, unsigned char **dstPlanes,
+  int width, int *strides, int height, int flags);
+
+
 /**
  * Destroy a TurboJPEG compressor, decompressor, or transformer instance.
  *
@@ -486,6 +541,8 @@ DLLEXPORT int DLLCALL tjDestroy(tjhandle handle);
 
 /**
  * Returns a descriptive error message explaining why the last command failed.
+ * The message is kept per thread, so it describes the last command that failed
+ * on the calling thread.
  *
  * @return a descriptive error message explaining why the last command failed.
  */
@@ -18,6 +18,8 @@
 
 #include "rfbclient.h"
 #include "data-control.h"
+#include "dirty-tiles.h"
+#include "jpeg-pool.h"
 
 #include <stdbool.h>
 #include <unistd.h>
@@ -25,15 +27,49 @@
 #include <wayland-client.h>
 
 #define VNC_CLIENT_MAX_AV_FRAMES 64
+#define VNC_CLIENT_MAX_COPY_RECTS 64
+#define VNC_CLIENT_MAX_YUV_RECTS 64
+#define VNC_CLIENT_MAX_JPEG_RECTS 256
 
 struct open_h264;
 struct AVFrame;
+struct aml_timer;
 
 struct vnc_av_frame {
 	struct AVFrame* frame;
 	int x, y, width, height;
 };
 
+struct vnc_copy_rect {
+	int src_x, src_y;
+	int dst_x, dst_y;
+	int width, height;
+};
+
+/* A Tight JPEG rect that is being decoded by the JPEG pool, or was decoded
+ * into YUV planes for the renderer to convert. In the latter case, its pixels
+ * are only written to the framebuffer once something reads them from there,
+ * and only where nothing has been drawn over them.
+ */
+struct vnc_jpeg_rect {
+	struct wl_list link;
+	int x, y, width, height;
+	uint8_t* data;
+	size_t length;
+
+	struct jpeg_job job;
+	bool is_pending;
+
+	// Where the framebuffer is still missing the pixels of this rect
+	struct pixman_region32 stale;
+
+	// Planes are kept until the renderer has drawn them
+	int subsamp;
+	uint8_t* planes[3];
+	int strides[3];
+	int plane_width[3], plane_height[3];
+};
+
 struct vnc_client {
 	rfbClient* client;
 
@@ -49,10 +85,56 @@ struct vnc_client {
 	void (*cut_text)(struct vnc_client*, const char*, size_t);
 
 	void* userdata;
-	struct pixman_region16 damage;
+	struct dirty_tiles damage;
+
+	/* CopyRects of the current update that the renderer may repeat on its
+	 * own copy of the framebuffer. Their destinations are not included in
+	 * the damage.
+	 */
+	bool record_copy_rects;
+	struct vnc_copy_rect copy_rects[VNC_CLIENT_MAX_COPY_RECTS];
+	int n_copy_rects;
+	bool current_rect_is_copy;
+	GotCopyRectProc got_copy_rect;
+
+	/* JPEG rects that the renderer is yet to draw, and the ones that the
+	 * framebuffer is still missing pixels of, newest last.
+	 */
+	bool decode_yuv;
+	void* tjhnd;
+	struct vnc_jpeg_rect* yuv_rects[VNC_CLIENT_MAX_YUV_RECTS];
+	int n_yuv_rects;
+	struct wl_list jpeg_rects;
+	int n_jpeg_rects;
+	struct pixman_region32 stale_region;
+	struct pixman_region32 pending_region;
+	// A rect from the pool couldn't be decoded, so the update has failed
+	bool is_jpeg_failed;
+	bool current_rect_is_yuv;
+
+	// Integer factor by which the server scales the desktop down
+	int server_scale;
+
+	// Integer factor by which the local framebuffer is kept reduced
+	int decode_scale;
 
 	bool handler_lock;
 	bool is_updating;
+
+	/* Regions that were drawn from lossy (JPEG) rects and are yet to be
+	 * refreshed losslessly.
+	 */
+	struct pixman_region32 lossy_region;
+	struct pixman_region32 refine_region;
+	bool current_rect_is_lossy;
+	bool is_current_rect_tracked;
+	bool is_lossy_region_damaged;
+	bool is_refining;
+	int refine_countdown;
+	uint64_t last_lossy_damage;
+	uint64_t lossless_refresh_delay; // us
+	struct aml_timer* lossless_refresh_timer;
+	bool is_lossless_refresh_pending;
 };
 
 struct vnc_client* vnc_client_create(struct data_control* data_control);
@@ -71,6 +153,13 @@ void* vnc_client_get_fb(const struct vnc_client* self);
 void vnc_client_set_fb(struct vnc_client* self, void* fb);
 const char* vnc_client_get_desktop_name(const struct vnc_client* self);
 int vnc_client_process(struct vnc_client* self);
+void vnc_client_set_update_rect(struct vnc_client* self, int x, int y,
+		int width, int height);
+int vnc_client_set_desktop_size(struct vnc_client* self, int width,
+		int height);
+int vnc_client_set_server_scale(struct vnc_client* self, int scale);
+int vnc_client_set_decode_scale(struct vnc_client* self, int scale);
+void vnc_client_set_updates_paused(struct vnc_client* self, bool is_paused);
 void vnc_client_send_pointer_event(struct vnc_client* self, int x, int y,
 		uint32_t button_mask);
 void vnc_client_send_keyboard_event(struct vnc_client* self, uint32_t symbol,
@@ -78,8 +167,14 @@ void vnc_client_send_keyboard_event(struct vnc_client* self, uint32_t symbol,
 void vnc_client_set_encodings(struct vnc_client* self, const char* encodings);
 void vnc_client_set_quality_level(struct vnc_client* self, int value);
 void vnc_client_set_compression_level(struct vnc_client* self, int value);
+void vnc_client_set_lossless_refresh_delay(struct vnc_client* self,
+		int delay_ms);
 void vnc_client_send_cut_text(struct vnc_client* self, const char* text,
 		size_t len);
 void vnc_client_clear_av_frames(struct vnc_client* self);
+void vnc_client_set_decode_yuv(struct vnc_client* self, bool enable);
+void vnc_client_clear_yuv_rects(struct vnc_client* self);
+int vnc_client_resolve_yuv_rect(struct vnc_client* self,
+		struct vnc_jpeg_rect* rect);
 rfbCredential* handle_vnc_authentication(struct _rfbClient *client, int credentialType);
 void cut_text (struct vnc_client* self, const char* text, size_t size);
\ No newline at end of file
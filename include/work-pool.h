@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+// The number of threads that the pool starts at most
+#define WORK_POOL_MAX_THREADS 8
+
+/* Runs the job. The worker is 0 on the calling thread and unique among the
+ * threads of the pool otherwise, so it can index per-thread state.
+ */
+typedef void (*work_fn)(void* userdata, int worker);
+
+int work_pool_init(void);
+void work_pool_finish(void);
+
+// Threads of the pool, not counting the calling thread
+int work_pool_get_n_threads(void);
+
+void work_pool_submit(work_fn fn, void* userdata);
+void work_pool_wait(void);
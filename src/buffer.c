@@ -18,6 +18,7 @@
 #include "shm.h"
 #include "pixels.h"
 #include "linux-dmabuf-unstable-v1.h"
+#include "sync-timeline.h"
 
 #include <stdlib.h>
 #include <sys/mman.h>
@@ -60,7 +61,7 @@ struct buffer* buffer_create_shm(int width, int height, int stride,
 	self->stride = stride;
 	self->format = format;
 
-	pixman_region_init_rect(&self->damage, 0, 0, width, height);
+	pixman_region32_init_rect(&self->damage, 0, 0, width, height);
 
 	self->size = height * stride;
 	int fd = shm_alloc_fd(self->size);
@@ -98,7 +99,39 @@ failure:
 	return NULL;
 }
 
-struct buffer* buffer_create_dmabuf(int width, int height, uint32_t format)
+static struct gbm_bo* create_bo(int width, int height, uint32_t format,
+		const uint64_t* modifiers, int n_modifiers, bool scanout)
+{
+	struct gbm_bo* bo = NULL;
+
+	if (n_modifiers > 0) {
+		uint32_t flags = GBM_BO_USE_RENDERING;
+		if (scanout)
+			flags |= GBM_BO_USE_SCANOUT;
+
+		bo = gbm_bo_create_with_modifiers2(gbm_device, width, height,
+				format, modifiers, n_modifiers, flags);
+		if (!bo && scanout)
+			bo = gbm_bo_create_with_modifiers2(gbm_device, width,
+					height, format, modifiers, n_modifiers,
+					GBM_BO_USE_RENDERING);
+
+		// The renderer only imports single plane buffers
+		if (bo && gbm_bo_get_plane_count(bo) != 1) {
+			gbm_bo_destroy(bo);
+			bo = NULL;
+		}
+	}
+
+	if (!bo)
+		bo = gbm_bo_create(gbm_device, width, height, format,
+				GBM_BO_USE_RENDERING);
+
+	return bo;
+}
+
+struct buffer* buffer_create_dmabuf(int width, int height, uint32_t format,
+		const uint64_t* modifiers, int n_modifiers, bool scanout)
 {
 	assert(gbm_device && zwp_linux_dmabuf_v1);
 
@@ -111,10 +144,10 @@ struct buffer* buffer_create_dmabuf(int width, int height, uint32_t format)
 	self->height = height;
 	self->format = format;
 
-	pixman_region_init_rect(&self->damage, 0, 0, width, height);
+	pixman_region32_init_rect(&self->damage, 0, 0, width, height);
 
-	self->bo = gbm_bo_create(gbm_device, width, height, format,
-			GBM_BO_USE_RENDERING);
+	self->bo = create_bo(width, height, format, modifiers, n_modifiers,
+			scanout);
 	if (!self->bo)
 		goto bo_failure;
 
@@ -159,11 +192,19 @@ void buffer_destroy(struct buffer* self)
 	if (!self)
 		return;
 
-	if (self->is_attached)
+	/* The compositor may still read from it, so wait until it's released.
+	 * With explicit sync, wl_buffer.release may never arrive, but the
+	 * compositor keeps its own reference to the dmabuf and nothing writes
+	 * to it any more.
+	 */
+	if (self->is_attached && !self->timeline) {
 		self->please_clean_up = true;
+		return;
+	}
 
-	pixman_region_fini(&self->damage);
+	pixman_region32_fini(&self->damage);
 	wl_buffer_destroy(self->wl_buffer);
+	sync_timeline_destroy(self->timeline);
 
 	switch (self->type) {
 	case BUFFER_WL_SHM:
@@ -179,3 +220,26 @@ void buffer_destroy(struct buffer* self)
 
 	free(self);
 }
+
+/* wl_buffer.release is unreliable with explicit sync, so the release point is
+ * checked instead.
+ */
+void buffer_poll_release(struct buffer* self)
+{
+	if (!self->timeline || !self->is_attached || self->release_point == 0)
+		return;
+
+	if (sync_timeline_is_signalled(self->timeline, self->release_point))
+		self->is_attached = false;
+}
+
+/* Whether the GPU can be made to wait for the compositor to release the buffer,
+ * i.e. whether the compositor has attached a fence to the release point.
+ */
+bool buffer_is_release_available(const struct buffer* self)
+{
+	if (!self->timeline || !self->is_attached || self->release_point == 0)
+		return true;
+
+	return sync_timeline_is_available(self->timeline, self->release_point);
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "dirty-tiles.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pixman.h>
+
+int dirty_tiles_resize(struct dirty_tiles* self, int width, int height)
+{
+	int cols = (width + DIRTY_TILE_SIZE - 1) / DIRTY_TILE_SIZE;
+	int rows = (height + DIRTY_TILE_SIZE - 1) / DIRTY_TILE_SIZE;
+
+	uint8_t* map = calloc(1, cols * rows + 1);
+	if (!map)
+		return -1;
+
+	free(self->map);
+	self->map = map;
+	self->width = width;
+	self->height = height;
+	self->cols = cols;
+	self->rows = rows;
+	self->row_min = rows;
+	self->row_max = -1;
+
+	return 0;
+}
+
+void dirty_tiles_destroy(struct dirty_tiles* self)
+{
+	free(self->map);
+	self->map = NULL;
+}
+
+void dirty_tiles_mark(struct dirty_tiles* self, int x, int y, int width,
+		int height)
+{
+	int x2 = x + width;
+	int y2 = y + height;
+
+	x = x > 0 ? x : 0;
+	y = y > 0 ? y : 0;
+	x2 = x2 < self->width ? x2 : self->width;
+	y2 = y2 < self->height ? y2 : self->height;
+
+	if (!self->map || x >= x2 || y >= y2)
+		return;
+
+	int col1 = x / DIRTY_TILE_SIZE;
+	int col2 = (x2 - 1) / DIRTY_TILE_SIZE;
+	int row1 = y / DIRTY_TILE_SIZE;
+	int row2 = (y2 - 1) / DIRTY_TILE_SIZE;
+
+	for (int row = row1; row <= row2; ++row)
+		memset(self->map + row * self->cols + col1, 1, col2 - col1 + 1);
+
+	if (row1 < self->row_min)
+		self->row_min = row1;
+	if (row2 > self->row_max)
+		self->row_max = row2;
+}
+
+void dirty_tiles_clear(struct dirty_tiles* self)
+{
+	if (dirty_tiles_is_empty(self))
+		return;
+
+	memset(self->map + self->row_min * self->cols, 0,
+			(self->row_max - self->row_min + 1) * self->cols);
+
+	self->row_min = self->rows;
+	self->row_max = -1;
+}
+
+bool dirty_tiles_is_empty(const struct dirty_tiles* self)
+{
+	return !self->map || self->row_max < self->row_min;
+}
+
+bool dirty_tiles_intersects(const struct dirty_tiles* self, int x, int y,
+		int width, int height)
+{
+	if (dirty_tiles_is_empty(self) || width <= 0 || height <= 0)
+		return false;
+
+	int col1 = x / DIRTY_TILE_SIZE;
+	int col2 = (x + width - 1) / DIRTY_TILE_SIZE;
+	int row1 = y / DIRTY_TILE_SIZE;
+	int row2 = (y + height - 1) / DIRTY_TILE_SIZE;
+
+	if (col2 >= self->cols)
+		col2 = self->cols - 1;
+	if (row1 < self->row_min)
+		row1 = self->row_min;
+	if (row2 > self->row_max)
+		row2 = self->row_max;
+
+	for (int row = row1; row <= row2; ++row)
+		for (int col = col1; col <= col2; ++col)
+			if (self->map[row * self->cols + col])
+				return true;
+
+	return false;
+}
+
+/* Runs of dirty tiles become boxes, which pixman coalesces with the runs of
+ * the rows above and below.
+ */
+void dirty_tiles_to_region(const struct dirty_tiles* self,
+		struct pixman_region32* dst)
+{
+	if (dirty_tiles_is_empty(self))
+		return;
+
+	int max_boxes = (self->row_max - self->row_min + 1) *
+		((self->cols + 1) / 2);
+	struct pixman_box32* boxes = malloc(max_boxes * sizeof(*boxes));
+	if (!boxes) {
+		pixman_region32_union_rect(dst, dst, 0, 0, self->width,
+				self->height);
+		return;
+	}
+
+	int n_boxes = 0;
+
+	for (int row = self->row_min; row <= self->row_max; ++row) {
+		const uint8_t* tiles = self->map + row * self->cols;
+		int y1 = row * DIRTY_TILE_SIZE;
+		int y2 = y1 + DIRTY_TILE_SIZE;
+		if (y2 > self->height)
+			y2 = self->height;
+
+		int col = 0;
+		while (col < self->cols) {
+			if (!tiles[col]) {
+				++col;
+				continue;
+			}
+
+			int start = col;
+			while (col < self->cols && tiles[col])
+				++col;
+
+			int x2 = col * DIRTY_TILE_SIZE;
+
+			boxes[n_boxes++] = (struct pixman_box32) {
+				.x1 = start * DIRTY_TILE_SIZE,
+				.y1 = y1,
+				.x2 = x2 < self->width ? x2 : self->width,
+				.y2 = y2,
+			};
+		}
+	}
+
+	struct pixman_region32 region;
+	pixman_region32_init_rects(&region, boxes, n_boxes);
+	pixman_region32_union(dst, dst, &region);
+	pixman_region32_fini(&region);
+
+	free(boxes);
+}
@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "dmabuf-feedback.h"
+#include "linux-dmabuf-unstable-v1.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <wayland-client.h>
+#include <drm_fourcc.h>
+#include <xf86drm.h>
+
+// Supported formats in order of preference
+static const uint32_t supported_formats[] = {
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_XBGR8888,
+};
+
+#define N_SUPPORTED_FORMATS \
+	(sizeof(supported_formats) / sizeof(supported_formats[0]))
+
+_Static_assert(N_SUPPORTED_FORMATS == DMABUF_FEEDBACK_N_FORMATS,
+		"DMABUF_FEEDBACK_N_FORMATS must match the supported formats");
+
+struct format_table_entry {
+	uint32_t format;
+	uint32_t padding;
+	uint64_t modifier;
+};
+
+static int append_modifier(uint64_t** modifiers, int* n, uint64_t modifier)
+{
+	for (int i = 0; i < *n; ++i)
+		if ((*modifiers)[i] == modifier)
+			return 0;
+
+	uint64_t* tmp = realloc(*modifiers, (*n + 1) * sizeof(*tmp));
+	if (!tmp)
+		return -1;
+
+	tmp[(*n)++] = modifier;
+	*modifiers = tmp;
+	return 0;
+}
+
+static void reset_tranche(struct dmabuf_feedback* self)
+{
+	self->tranche_flags = 0;
+
+	for (size_t i = 0; i < N_SUPPORTED_FORMATS; ++i) {
+		free(self->tranche_modifiers[i]);
+		self->tranche_modifiers[i] = NULL;
+		self->n_tranche_modifiers[i] = 0;
+	}
+}
+
+static void handle_done(void* data,
+		struct zwp_linux_dmabuf_feedback_v1* feedback)
+{
+	struct dmabuf_feedback* self = data;
+
+	free(self->modifiers);
+	self->format = self->pending_format;
+	self->modifiers = self->pending_modifiers;
+	self->n_modifiers = self->n_pending_modifiers;
+	self->is_scanout = self->pending_is_scanout;
+
+	self->pending_format = DRM_FORMAT_INVALID;
+	self->pending_modifiers = NULL;
+	self->n_pending_modifiers = 0;
+	self->pending_is_scanout = false;
+
+	self->is_done = true;
+
+	if (self->on_done)
+		self->on_done(self, self->userdata);
+}
+
+static void handle_format_table(void* data,
+		struct zwp_linux_dmabuf_feedback_v1* feedback, int32_t fd,
+		uint32_t size)
+{
+	struct dmabuf_feedback* self = data;
+
+	if (self->table)
+		munmap(self->table, self->table_size);
+	self->table = NULL;
+	self->table_size = 0;
+
+	void* table = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (table == MAP_FAILED)
+		return;
+
+	self->table = table;
+	self->table_size = size;
+}
+
+static void handle_main_device(void* data,
+		struct zwp_linux_dmabuf_feedback_v1* feedback,
+		struct wl_array* device)
+{
+	struct dmabuf_feedback* self = data;
+
+	if (device->size != sizeof(dev_t))
+		return;
+
+	memcpy(&self->main_device, device->data, sizeof(dev_t));
+	self->have_main_device = true;
+}
+
+static void handle_tranche_done(void* data,
+		struct zwp_linux_dmabuf_feedback_v1* feedback)
+{
+	struct dmabuf_feedback* self = data;
+
+	// Only the most preferred usable tranche is of interest
+	if (self->pending_format != DRM_FORMAT_INVALID)
+		goto done;
+
+	for (size_t i = 0; i < N_SUPPORTED_FORMATS; ++i) {
+		if (self->n_tranche_modifiers[i] == 0)
+			continue;
+
+		if (self->required_format != DRM_FORMAT_INVALID &&
+				supported_formats[i] != self->required_format)
+			continue;
+
+		self->pending_format = supported_formats[i];
+		self->pending_modifiers = self->tranche_modifiers[i];
+		self->n_pending_modifiers = self->n_tranche_modifiers[i];
+		self->pending_is_scanout = self->tranche_flags &
+			ZWP_LINUX_DMABUF_FEEDBACK_V1_TRANCHE_FLAGS_SCANOUT;
+
+		self->tranche_modifiers[i] = NULL;
+		self->n_tranche_modifiers[i] = 0;
+		break;
+	}
+
+done:
+	reset_tranche(self);
+}
+
+static void handle_tranche_target_device(void* data,
+		struct zwp_linux_dmabuf_feedback_v1* feedback,
+		struct wl_array* device)
+{
+	// The buffers are allocated on the main device either way
+}
+
+static void handle_tranche_formats(void* data,
+		struct zwp_linux_dmabuf_feedback_v1* feedback,
+		struct wl_array* indices)
+{
+	struct dmabuf_feedback* self = data;
+
+	if (!self->table)
+		return;
+
+	const struct format_table_entry* table = self->table;
+	size_t table_len = self->table_size / sizeof(*table);
+
+	uint16_t* index;
+	wl_array_for_each(index, indices) {
+		if (*index >= table_len)
+			continue;
+
+		const struct format_table_entry* entry = &table[*index];
+
+		for (size_t i = 0; i < N_SUPPORTED_FORMATS; ++i)
+			if (entry->format == supported_formats[i])
+				append_modifier(&self->tranche_modifiers[i],
+						&self->n_tranche_modifiers[i],
+						entry->modifier);
+	}
+}
+
+static void handle_tranche_flags(void* data,
+		struct zwp_linux_dmabuf_feedback_v1* feedback, uint32_t flags)
+{
+	struct dmabuf_feedback* self = data;
+	self->tranche_flags = flags;
+}
+
+static const struct zwp_linux_dmabuf_feedback_v1_listener feedback_listener = {
+	.done = handle_done,
+	.format_table = handle_format_table,
+	.main_device = handle_main_device,
+	.tranche_done = handle_tranche_done,
+	.tranche_target_device = handle_tranche_target_device,
+	.tranche_formats = handle_tranche_formats,
+	.tranche_flags = handle_tranche_flags,
+};
+
+static struct dmabuf_feedback* dmabuf_feedback_create(
+		struct zwp_linux_dmabuf_feedback_v1* feedback)
+{
+	if (!feedback)
+		return NULL;
+
+	struct dmabuf_feedback* self = calloc(1, sizeof(*self));
+	if (!self) {
+		zwp_linux_dmabuf_feedback_v1_destroy(feedback);
+		return NULL;
+	}
+
+	self->feedback = feedback;
+	self->format = DRM_FORMAT_INVALID;
+	self->pending_format = DRM_FORMAT_INVALID;
+	self->required_format = DRM_FORMAT_INVALID;
+
+	zwp_linux_dmabuf_feedback_v1_add_listener(self->feedback,
+			&feedback_listener, self);
+
+	return self;
+}
+
+struct dmabuf_feedback* dmabuf_feedback_get_default(
+		struct zwp_linux_dmabuf_v1* dmabuf)
+{
+	return dmabuf_feedback_create(
+			zwp_linux_dmabuf_v1_get_default_feedback(dmabuf));
+}
+
+/* Scanout tranches are normally only sent as surface feedback, because they
+ * depend on the output that the surface is shown on.
+ */
+struct dmabuf_feedback* dmabuf_feedback_get_surface(
+		struct zwp_linux_dmabuf_v1* dmabuf, struct wl_surface* surface,
+		uint32_t required_format)
+{
+	struct dmabuf_feedback* self = dmabuf_feedback_create(
+			zwp_linux_dmabuf_v1_get_surface_feedback(dmabuf,
+				surface));
+	if (self)
+		self->required_format = required_format;
+	return self;
+}
+
+void dmabuf_feedback_destroy(struct dmabuf_feedback* self)
+{
+	if (!self)
+		return;
+
+	reset_tranche(self);
+	if (self->table)
+		munmap(self->table, self->table_size);
+	free(self->pending_modifiers);
+	free(self->modifiers);
+	zwp_linux_dmabuf_feedback_v1_destroy(self->feedback);
+	free(self);
+}
+
+int dmabuf_feedback_open_main_device(const struct dmabuf_feedback* self)
+{
+	if (!self->have_main_device)
+		return -1;
+
+	drmDevice* device;
+	if (drmGetDeviceFromDevId(self->main_device, 0, &device) != 0)
+		return -1;
+
+	int fd = -1;
+	if (device->available_nodes & (1 << DRM_NODE_RENDER))
+		fd = open(device->nodes[DRM_NODE_RENDER], O_RDWR | O_CLOEXEC);
+
+	drmFreeDevice(&device);
+	return fd;
+}
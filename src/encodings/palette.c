@@ -0,0 +1,136 @@
+/*
+ *  Copyright (C) 2022 Andri Yngvason.  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * palette.c - expand packed palette indices.
+ *
+ * This file shouldn't be compiled directly.  It is included multiple times by
+ * rfbproto.c, each time with a different definition of the macro BPP.  For
+ * each value of BPP, this file defines a function which expands a row of
+ * palette indices into pixels with BPP bits per pixel.
+ *
+ * Tight, ZRLE and TRLE all pack indices most significant bits first, and
+ * start each row on a byte boundary.  Rather than shifting and masking every
+ * pixel, each byte is looked up in a table that holds the indices it packs.
+ * Two-colour rows, the most common kind, instead pick between the colours
+ * eight pixels at a time with GCC vector extensions, like the gradient filter
+ * in tight.c does.
+ */
+
+#ifndef PALETTE_INDICES
+#define PALETTE_INDICES
+
+#define PI1(b) { (b) >> 7 & 1, (b) >> 6 & 1, (b) >> 5 & 1, (b) >> 4 & 1, \
+                 (b) >> 3 & 1, (b) >> 2 & 1, (b) >> 1 & 1, (b) & 1 }
+#define PI2(b) { (b) >> 6 & 3, (b) >> 4 & 3, (b) >> 2 & 3, (b) & 3 }
+#define PI4(b) { (b) >> 4 & 15, (b) & 15 }
+
+#define PI_4(f, b) f(b), f((b) + 1), f((b) + 2), f((b) + 3)
+#define PI_16(f, b) PI_4(f, b), PI_4(f, (b) + 4), PI_4(f, (b) + 8), \
+                    PI_4(f, (b) + 12)
+#define PI_64(f, b) PI_16(f, b), PI_16(f, (b) + 16), PI_16(f, (b) + 32), \
+                    PI_16(f, (b) + 48)
+#define PI_256(f) PI_64(f, 0), PI_64(f, 64), PI_64(f, 128), PI_64(f, 192)
+
+static const uint8_t paletteIndices1[256][8] = { PI_256(PI1) };
+static const uint8_t paletteIndices2[256][4] = { PI_256(PI2) };
+static const uint8_t paletteIndices4[256][2] = { PI_256(PI4) };
+
+#undef PI_256
+#undef PI_64
+#undef PI_16
+#undef PI_4
+#undef PI4
+#undef PI2
+#undef PI1
+
+#endif
+
+#define CARDBPP CONCAT3E(uint,BPP,_t)
+#define PaletteLanesBPP CONCAT2E(PaletteLanes,BPP)
+#define UnpackPaletteRowBPP CONCAT2E(UnpackPaletteRow,BPP)
+
+/* One pixel per bit of an index byte. */
+typedef CARDBPP PaletteLanesBPP __attribute__((vector_size(BPP)));
+
+/*
+ * Expands w pixels with bpp-bit indices (1, 2, 4 or 8) from src into dst and
+ * returns the start of the next row.  The loops over the pixels of a byte
+ * have constant trip counts, so they are unrolled and leave only table
+ * lookups and stores.
+ */
+static uint8_t *
+UnpackPaletteRowBPP (CARDBPP *dst, uint8_t *src, int w, int bpp,
+                     const CARDBPP *palette)
+{
+  int i, k;
+  const uint8_t *idx;
+  const PaletteLanesBPP bits = { 128, 64, 32, 16, 8, 4, 2, 1 };
+  PaletteLanesBPP bg, fg, mask, pix;
+
+  switch (bpp) {
+  case 1:
+    /* Every lane is set to all ones where its bit is set, and selects the
+       foreground colour there. */
+    bg = (PaletteLanesBPP){ 0 } + palette[0];
+    fg = (PaletteLanesBPP){ 0 } + palette[1];
+    for (i = 0; i + 8 <= w; i += 8, dst += 8) {
+      mask = (PaletteLanesBPP)((bits & (CARDBPP)*src++) != 0);
+      pix = (bg & ~mask) | (fg & mask);
+      memcpy(dst, &pix, sizeof(pix));
+    }
+    if (i < w) {
+      idx = paletteIndices1[*src++];
+      for (k = 0; k < w - i; k++)
+        dst[k] = palette[idx[k]];
+    }
+    break;
+  case 2:
+    for (i = 0; i + 4 <= w; i += 4, dst += 4) {
+      idx = paletteIndices2[*src++];
+      for (k = 0; k < 4; k++)
+        dst[k] = palette[idx[k]];
+    }
+    if (i < w) {
+      idx = paletteIndices2[*src++];
+      for (k = 0; k < w - i; k++)
+        dst[k] = palette[idx[k]];
+    }
+    break;
+  case 4:
+    for (i = 0; i + 2 <= w; i += 2, dst += 2) {
+      idx = paletteIndices4[*src++];
+      dst[0] = palette[idx[0]];
+      dst[1] = palette[idx[1]];
+    }
+    if (i < w)
+      dst[0] = palette[*src++ >> 4];
+    break;
+  default:
+    for (i = 0; i < w; i++)
+      dst[i] = palette[src[i]];
+    src += w;
+    break;
+  }
+
+  return src;
+}
+
+#undef PaletteLanesBPP
+#undef CARDBPP
@@ -25,6 +25,10 @@
 
 #include "turbojpeg.h"
 
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+#include <png.h>
+#endif
+
 /*
  * tight.c - handle ``tight'' encoding.
  *
@@ -47,11 +51,20 @@
 #define FilterCopyBPP CONCAT2E(FilterCopy,BPP)
 #define FilterPaletteBPP CONCAT2E(FilterPalette,BPP)
 #define FilterGradientBPP CONCAT2E(FilterGradient,BPP)
+#define FilterDestBPP CONCAT2E(FilterDest,BPP)
+#define FlushFilterBPP CONCAT2E(FlushFilter,BPP)
 
 #if BPP != 8
 #define DecompressJpegRectBPP CONCAT2E(DecompressJpegRect,BPP)
 #endif
 
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+#define DecompressPngRectBPP CONCAT2E(DecompressPngRect,BPP)
+#define PngInfoBPP CONCAT2E(PngInfo,BPP)
+#define PngRowBPP CONCAT2E(PngRow,BPP)
+#define PngConvertRowBPP CONCAT2E(PngConvertRow,BPP)
+#endif
+
 #ifndef RGB_TO_PIXEL
 
 #define RGB_TO_PIXEL(bpp,r,g,b)						\
@@ -86,15 +99,21 @@ static int InitFilterGradientBPP (rfbClient* client, int rw, int rh);
 static void FilterCopyBPP (rfbClient* client, int srcx, int srcy, int numRows);
 static void FilterPaletteBPP (rfbClient* client, int srcx, int srcy, int numRows);
 static void FilterGradientBPP (rfbClient* client, int srcx, int srcy, int numRows);
+static CARDBPP *FilterDestBPP (rfbClient* client, int srcx, int srcy, int *dstWidth);
+static void FlushFilterBPP (rfbClient* client, int srcx, int srcy, int numRows);
 
 #if BPP != 8
 static rfbBool DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h);
 #endif
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+static rfbBool DecompressPngRectBPP(rfbClient* client, int x, int y, int w, int h);
+#endif
 
 /* Definitions */
 
 static rfbBool
-HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
+HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh,
+                rfbBool isPng)
 {
   CARDBPP fill_colour;
   uint8_t comp_ctl;
@@ -127,6 +146,12 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
     comp_ctl >>= 1;
   }
 
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+  /* TightPng reuses the "basic" without zlib value for PNG images. */
+  if (isPng && comp_ctl == rfbTightPng)
+    return DecompressPngRectBPP(client, rx, ry, rw, rh);
+#endif
+
   if ((comp_ctl & rfbTightNoZlib) == rfbTightNoZlib) {
      comp_ctl &= ~(rfbTightNoZlib);
      readUncompressed = TRUE;
@@ -165,6 +190,12 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
   }
 #endif
 
+  /* TightPng has no basic compression. */
+  if (isPng) {
+    rfbClientLog("TightPng encoding: bad subencoding value received.\n");
+    return FALSE;
+  }
+
   /* Quit on unsupported subencoding value. */
   if (comp_ctl > rfbTightMaxSubencoding) {
     rfbClientLog("Tight encoding: bad subencoding value received.\n");
@@ -202,11 +233,18 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
     filterFn = FilterCopyBPP;
     bitsPixel = InitFilterCopyBPP(client, rw, rh);
   }
+  /* The filter has already logged why it couldn't allocate its buffers. */
+  if (bitsPixel < 0)
+    return FALSE;
   if (bitsPixel == 0) {
     rfbClientLog("Tight encoding: error receiving palette.\n");
     return FALSE;
   }
 
+  if (client->frameBufferDownscale > 1 &&
+      !AllocStagingBuffer(client, (size_t)rw * rh * (BPP / 8)))
+    return FALSE;
+
   /* Determine if the data should be decompressed or just copied. */
   rowSize = (rw * bitsPixel + 7) / 8;
   if (rh * rowSize < TIGHT_MIN_TO_COMPRESS) {
@@ -214,6 +252,7 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
       return FALSE;
 
     filterFn(client, rx, ry, rh);
+    FlushFilterBPP(client, rx, ry, rh);
 
     return TRUE;
   }
@@ -234,6 +273,7 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
       return FALSE;
 
     filterFn(client, rx, ry, rh);
+    FlushFilterBPP(client, rx, ry, rh);
 
     return TRUE;
   }
@@ -299,6 +339,7 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
       numRows = (bufferSize - zs->avail_out) / rowSize;
 
       filterFn(client, rx, ry+rowsProcessed, numRows);
+      FlushFilterBPP(client, rx, ry+rowsProcessed, numRows);
 
       extraBytes = bufferSize - zs->avail_out - numRows * rowSize;
       if (extraBytes > 0)
@@ -323,6 +364,32 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
  *
  */
 
+/*
+ * Filters write straight into the framebuffer unless it is kept at reduced
+ * resolution, in which case rows are staged at full resolution and handed to
+ * GotBitmap for downsampling.
+ */
+
+static CARDBPP *
+FilterDestBPP (rfbClient* client, int srcx, int srcy, int *dstWidth)
+{
+  if (client->frameBufferDownscale > 1) {
+    *dstWidth = client->rectWidth;
+    return (CARDBPP *)client->stagingBuffer;
+  }
+
+  *dstWidth = client->width;
+  return (CARDBPP *)&client->frameBuffer[(srcy * client->width + srcx) * BPP / 8];
+}
+
+static void
+FlushFilterBPP (rfbClient* client, int srcx, int srcy, int numRows)
+{
+  if (client->frameBufferDownscale > 1 && numRows > 0)
+    client->GotBitmap(client, client->stagingBuffer, srcx, srcy,
+		      client->rectWidth, numRows);
+}
+
 static int
 InitFilterCopyBPP (rfbClient* client, int rw, int rh)
 {
@@ -344,8 +411,8 @@ InitFilterCopyBPP (rfbClient* client, int rw, int rh)
 static void
 FilterCopyBPP (rfbClient* client, int srcx, int srcy, int numRows)
 {
-  CARDBPP *dst =
-    (CARDBPP *)&client->frameBuffer[(srcy * client->width + srcx) * BPP / 8];
+  int dstWidth;
+  CARDBPP *dst = FilterDestBPP(client, srcx, srcy, &dstWidth);
   int y;
 
 #if BPP == 32
@@ -354,7 +421,7 @@ FilterCopyBPP (rfbClient* client, int srcx, int srcy, int numRows)
   if (client->cutZeros) {
     for (y = 0; y < numRows; y++) {
       for (x = 0; x < client->rectWidth; x++) {
-	dst[y*client->width+x] =
+	dst[y*dstWidth+x] =
 	  RGB24_TO_PIXEL32(client->buffer[(y*client->rectWidth+x)*3],
 			   client->buffer[(y*client->rectWidth+x)*3+1],
 			   client->buffer[(y*client->rectWidth+x)*3+2]);
@@ -365,121 +432,110 @@ FilterCopyBPP (rfbClient* client, int srcx, int srcy, int numRows)
 #endif
 
   for (y = 0; y < numRows; y++)
-    memcpy (&dst[y*client->width],
+    memcpy (&dst[y*dstWidth],
             &client->buffer[y * client->rectWidth * (BPP / 8)],
             client->rectWidth * (BPP / 8));
 }
 
-static int
-InitFilterGradientBPP (rfbClient* client, int rw, int rh)
-{
-  int bits;
+#ifndef TIGHT_GRADIENT_COMMON
+#define TIGHT_GRADIENT_COMMON
 
-  bits = InitFilterCopyBPP(client, rw, rh);
-  if (client->cutZeros)
-    memset(client->tightPrevRow, 0, rw * 3);
-  else
-    memset(client->tightPrevRow, 0, rw * 3 * sizeof(uint16_t));
+/*
+ * The gradient filter predicts each pixel from its left, upper and upper-left
+ * neighbours, clamped to the channel range. The clamp keeps the recurrence
+ * along a row serial, so the three channels of a pixel are reconstructed
+ * side by side in one vector instead. The previous row is kept in the same
+ * layout and updated in place.
+ */
+typedef int32_t TightGradientPixel __attribute__((vector_size(16), aligned(4)));
 
-  return bits;
+static inline TightGradientPixel
+TightGradientPredict (TightGradientPixel up, TightGradientPixel left,
+                      TightGradientPixel upLeft, TightGradientPixel max)
+{
+  TightGradientPixel est = up + left - upLeft;
+  TightGradientPixel over;
+
+  est &= est >= 0;
+  over = est > max;
+  return (est & ~over) | (max & over);
 }
 
-#if BPP == 32
+#endif
 
-static void
-FilterGradient24 (rfbClient* client, int srcx, int srcy, int numRows)
+static int
+InitFilterGradientBPP (rfbClient* client, int rw, int rh)
 {
-  CARDBPP *dst =
-    (CARDBPP *)&client->frameBuffer[(srcy * client->width + srcx) * BPP / 8];
-  int x, y, c;
-  uint8_t thisRow[2048*3];
-  uint8_t pix[3];
-  int est[3];
-
-  for (y = 0; y < numRows; y++) {
+  int bits;
+  size_t size = (size_t)rw * sizeof(TightGradientPixel);
 
-    /* First pixel in a row */
-    for (c = 0; c < 3; c++) {
-      pix[c] = client->tightPrevRow[c] + client->buffer[y*client->rectWidth*3+c];
-      thisRow[c] = pix[c];
-    }
-    dst[y*client->width] = RGB24_TO_PIXEL32(pix[0], pix[1], pix[2]);
-
-    /* Remaining pixels of a row */
-    for (x = 1; x < client->rectWidth; x++) {
-      for (c = 0; c < 3; c++) {
-	est[c] = (int)client->tightPrevRow[x*3+c] + (int)pix[c] -
-		 (int)client->tightPrevRow[(x-1)*3+c];
-	if (est[c] > 0xFF) {
-	  est[c] = 0xFF;
-	} else if (est[c] < 0x00) {
-	  est[c] = 0x00;
-	}
-	pix[c] = (uint8_t)est[c] + client->buffer[(y*client->rectWidth+x)*3+c];
-	thisRow[x*3+c] = pix[c];
-      }
-      dst[y*client->width+x] = RGB24_TO_PIXEL32(pix[0], pix[1], pix[2]);
-    }
+  bits = InitFilterCopyBPP(client, rw, rh);
+  if (!AllocTightPrevRow(client, size))
+    return -1;
+  memset(client->tightPrevRow, 0, size);
 
-    memcpy(client->tightPrevRow, thisRow, client->rectWidth * 3);
-  }
+  return bits;
 }
 
-#endif
-
 static void
 FilterGradientBPP (rfbClient* client, int srcx, int srcy, int numRows)
 {
-  CARDBPP *dst =
-    (CARDBPP *)&client->frameBuffer[(srcy * client->width + srcx) * BPP / 8];
-  int x, y, c;
+  int dstWidth;
+  CARDBPP *dst = FilterDestBPP(client, srcx, srcy, &dstWidth);
+  int x, y;
   CARDBPP *src = (CARDBPP *)client->buffer;
-  uint16_t *thatRow = (uint16_t *)client->tightPrevRow;
-  uint16_t thisRow[2048*3];
-  uint16_t pix[3];
-  uint16_t max[3];
+  TightGradientPixel *prevRow = (TightGradientPixel *)client->tightPrevRow;
+  TightGradientPixel up, left, upLeft, delta, max, pix;
   int shift[3];
-  int est[3];
 
 #if BPP == 32
   if (client->cutZeros) {
-    FilterGradient24(client, srcx, srcy, numRows);
+    const uint8_t *src24 = (const uint8_t *)client->buffer;
+    max = (TightGradientPixel){ 0xFF, 0xFF, 0xFF, 0 };
+
+    for (y = 0; y < numRows; y++) {
+      left = upLeft = (TightGradientPixel){ 0 };
+
+      for (x = 0; x < client->rectWidth; x++, src24 += 3) {
+        up = prevRow[x];
+        delta = (TightGradientPixel){ src24[0], src24[1], src24[2], 0 };
+        pix = (TightGradientPredict(up, left, upLeft, max) + delta) & max;
+
+        prevRow[x] = pix;
+        upLeft = up;
+        left = pix;
+
+        dst[y*dstWidth+x] = RGB24_TO_PIXEL32(pix[0], pix[1], pix[2]);
+      }
+    }
     return;
   }
 #endif
 
-  max[0] = client->format.redMax;
-  max[1] = client->format.greenMax;
-  max[2] = client->format.blueMax;
+  max = (TightGradientPixel){ client->format.redMax, client->format.greenMax,
+                              client->format.blueMax, 0 };
 
   shift[0] = client->format.redShift;
   shift[1] = client->format.greenShift;
   shift[2] = client->format.blueShift;
 
   for (y = 0; y < numRows; y++) {
+    left = upLeft = (TightGradientPixel){ 0 };
 
-    /* First pixel in a row */
-    for (c = 0; c < 3; c++) {
-      pix[c] = (uint16_t)(((src[y*client->rectWidth] >> shift[c]) + thatRow[c]) & max[c]);
-      thisRow[c] = pix[c];
-    }
-    dst[y*client->width] = RGB_TO_PIXEL(BPP, pix[0], pix[1], pix[2]);
-
-    /* Remaining pixels of a row */
-    for (x = 1; x < client->rectWidth; x++) {
-      for (c = 0; c < 3; c++) {
-	est[c] = (int)thatRow[x*3+c] + (int)pix[c] - (int)thatRow[(x-1)*3+c];
-	if (est[c] > (int)max[c]) {
-	  est[c] = (int)max[c];
-	} else if (est[c] < 0) {
-	  est[c] = 0;
-	}
-	pix[c] = (uint16_t)(((src[y*client->rectWidth+x] >> shift[c]) + est[c]) & max[c]);
-	thisRow[x*3+c] = pix[c];
-      }
-      dst[y*client->width+x] = RGB_TO_PIXEL(BPP, pix[0], pix[1], pix[2]);
+    for (x = 0; x < client->rectWidth; x++) {
+      CARDBPP s = src[y*client->rectWidth+x];
+
+      up = prevRow[x];
+      delta = (TightGradientPixel){ s >> shift[0], s >> shift[1],
+                                    s >> shift[2], 0 };
+      pix = (TightGradientPredict(up, left, upLeft, max) + delta) & max;
+
+      prevRow[x] = pix;
+      upLeft = up;
+      left = pix;
+
+      dst[y*dstWidth+x] = RGB_TO_PIXEL(BPP, pix[0], pix[1], pix[2]);
     }
-    memcpy(thatRow, thisRow, client->rectWidth * 3 * sizeof(uint16_t));
   }
 }
 
@@ -524,28 +580,16 @@ InitFilterPaletteBPP (rfbClient* client, int rw, int rh)
 static void
 FilterPaletteBPP (rfbClient* client, int srcx, int srcy, int numRows)
 {
-  int x, y, b, w;
-  CARDBPP *dst =
-    (CARDBPP *)&client->frameBuffer[(srcy * client->width + srcx) * BPP / 8];
+  int y;
+  int dstWidth;
+  CARDBPP *dst = FilterDestBPP(client, srcx, srcy, &dstWidth);
   uint8_t *src = (uint8_t *)client->buffer;
   CARDBPP *palette = (CARDBPP *)client->tightPalette;
+  int bpp = client->rectColors == 2 ? 1 : 8;
 
-  if (client->rectColors == 2) {
-    w = (client->rectWidth + 7) / 8;
-    for (y = 0; y < numRows; y++) {
-      for (x = 0; x < client->rectWidth / 8; x++) {
-	for (b = 7; b >= 0; b--)
-	  dst[y*client->width+x*8+7-b] = palette[src[y*w+x] >> b & 1];
-      }
-      for (b = 7; b >= 8 - client->rectWidth % 8; b--) {
-	dst[y*client->width+x*8+7-b] = palette[src[y*w+x] >> b & 1];
-      }
-    }
-  } else {
-    for (y = 0; y < numRows; y++)
-      for (x = 0; x < client->rectWidth; x++)
-	dst[y*client->width+x] = palette[(int)src[y*client->rectWidth+x]];
-  }
+  for (y = 0; y < numRows; y++)
+    src = UnpackPaletteRowBPP(&dst[y*dstWidth], src, client->rectWidth, bpp,
+                              palette);
 }
 
 #if BPP != 8
@@ -562,6 +606,7 @@ DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h)
   int compressedLen;
   uint8_t *compressedData, *dst;
   int pixelSize, pitch, flags = 0;
+  int scale, dx, dy, dw, dh, fbWidth;
 
   compressedLen = (int)ReadCompactLen(client);
   if (compressedLen <= 0) {
@@ -580,9 +625,16 @@ DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h)
     return FALSE;
   }
 
-  if(client->GotJpeg != NULL)
-    return client->GotJpeg(client, compressedData, compressedLen, x, y, w, h);
-  
+  if (client->GotLossyRect != NULL)
+    client->GotLossyRect(client, x, y, w, h);
+
+  if(client->GotJpeg != NULL) {
+    rfbBool ok = client->GotJpeg(client, compressedData, compressedLen,
+                                 x, y, w, h);
+    free(compressedData);
+    return ok;
+  }
+
   if (!client->tjhnd) {
     if ((client->tjhnd = tjInitDecompress()) == NULL) {
       rfbClientLog("TurboJPEG error: %s\n", tjGetErrorStr());
@@ -591,10 +643,21 @@ DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h)
     }
   }
 
+  /*
+   * A reduced-resolution framebuffer lets TurboJPEG skip most of the IDCT
+   * work by decoding straight at 1/2, 1/4 or 1/8 scale.
+   */
+  scale = client->frameBufferDownscale > 1 ? client->frameBufferDownscale : 1;
+  dx = x / scale;
+  dy = y / scale;
+  dw = (w + scale - 1) / scale;
+  dh = (h + scale - 1) / scale;
+  fbWidth = (client->width + scale - 1) / scale;
+
 #if BPP == 16
   flags = 0;
   pixelSize = 3;
-  pitch = w * pixelSize;
+  pitch = dw * pixelSize;
   dst = (uint8_t *)client->buffer;
 #else
   if (client->format.bigEndian) flags |= TJ_ALPHAFIRST;
@@ -602,12 +665,12 @@ DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h)
     flags |= TJ_BGR;
   if (client->format.bigEndian) flags ^= TJ_BGR;
   pixelSize = BPP / 8;
-  pitch = client->width * pixelSize;
-  dst = &client->frameBuffer[y * pitch + x * pixelSize];
+  pitch = fbWidth * pixelSize;
+  dst = &client->frameBuffer[dy * pitch + dx * pixelSize];
 #endif
 
   if (tjDecompress(client->tjhnd, compressedData, (unsigned long)compressedLen,
-                   dst, w, pitch, h, pixelSize, flags)==-1) {
+                   dst, dw, pitch, dh, pixelSize, flags)==-1) {
     rfbClientLog("TurboJPEG error: %s\n", tjGetErrorStr());
     free(compressedData);
     return FALSE;
@@ -617,18 +680,18 @@ DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h)
 
 #if BPP == 16
   pixelSize = BPP / 8;
-  pitch = client->width * pixelSize;
-  dst = &client->frameBuffer[y * pitch + x * pixelSize];
+  pitch = fbWidth * pixelSize;
+  dst = &client->frameBuffer[dy * pitch + dx * pixelSize];
   {
     CARDBPP *dst16=(CARDBPP *)dst, *dst2;
     char *src = client->buffer;
     int i, j;
 
-    for (j = 0; j < h; j++) {
-      for (i = 0, dst2 = dst16; i < w; i++, dst2++, src += 3) {
+    for (j = 0; j < dh; j++) {
+      for (i = 0, dst2 = dst16; i < dw; i++, dst2++, src += 3) {
         *dst2 = RGB24_TO_PIXEL(BPP, src[0], src[1], src[2]);
       }
-      dst16 += client->width;
+      dst16 += fbWidth;
     }
   }
 #endif
@@ -662,6 +725,234 @@ ReadCompactLen (rfbClient* client)
 
 #endif
 
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+
+/*----------------------------------------------------------------------------
+ *
+ * PNG decompression.
+ *
+ * The image is fed to libpng as it arrives from the server, and rows are
+ * written out from its row callback. If libpng can produce the pixel format
+ * of the framebuffer, rows go straight into it. Otherwise they are decoded
+ * to RGB and converted, which is also how the reduced-resolution framebuffer
+ * gets its rows. Interlaced images in RGB are only converted once complete.
+ */
+
+#ifndef TIGHT_PNG_COMMON
+#define TIGHT_PNG_COMMON
+
+typedef struct {
+  rfbClient *client;
+  int x, y, w, h;
+  rfbBool direct;
+  rfbBool finished;
+  uint8_t *image;
+} TightPngState;
+
+static void
+TightPngError (png_structp png, png_const_charp msg)
+{
+  rfbClientLog("TightPng encoding: %s.\n", msg);
+  png_longjmp(png, 1);
+}
+
+static void
+TightPngWarning (png_structp png, png_const_charp msg)
+{
+}
+
+static void
+TightPngEnd (png_structp png, png_infop info)
+{
+  TightPngState *state = png_get_progressive_ptr(png);
+
+  state->finished = TRUE;
+}
+
+/*
+ * Finds out if the framebuffer holds 8-bit channels in one of the byte
+ * orders that libpng can fill in: RGBX, BGRX, XRGB or XBGR.
+ */
+static rfbBool
+TightPngIsDirect (rfbClient* client, rfbBool *bgr, rfbBool *fillerAfter)
+{
+  int r, g, b;
+
+  if (client->frameBufferDownscale > 1 || client->format.bitsPerPixel != 32 ||
+      client->format.redMax != 0xFF || client->format.greenMax != 0xFF ||
+      client->format.blueMax != 0xFF)
+    return FALSE;
+
+  if (client->format.redShift % 8 || client->format.greenShift % 8 ||
+      client->format.blueShift % 8)
+    return FALSE;
+
+  r = client->format.redShift / 8;
+  g = client->format.greenShift / 8;
+  b = client->format.blueShift / 8;
+  if (client->format.bigEndian) {
+    r = 3 - r;
+    g = 3 - g;
+    b = 3 - b;
+  }
+
+  if (g == 1 && r != b && r + b == 2) {
+    *fillerAfter = TRUE;
+    *bgr = r == 2;
+    return TRUE;
+  }
+
+  if (g == 2 && r != b && r + b == 4) {
+    *fillerAfter = FALSE;
+    *bgr = r == 3;
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+#endif
+
+static void
+PngConvertRowBPP (rfbClient* client, const uint8_t *src, int x, int y)
+{
+  int dstWidth, i;
+  CARDBPP *dst = FilterDestBPP(client, x, y, &dstWidth);
+
+  for (i = 0; i < client->rectWidth; i++, src += 3)
+    dst[i] = RGB24_TO_PIXEL(BPP, src[0], src[1], src[2]);
+
+  FlushFilterBPP(client, x, y, 1);
+}
+
+static void
+PngInfoBPP (png_structp png, png_infop info)
+{
+  TightPngState *state = png_get_progressive_ptr(png);
+  rfbBool bgr, fillerAfter;
+
+  if (png_get_image_width(png, info) != (png_uint_32)state->w ||
+      png_get_image_height(png, info) != (png_uint_32)state->h)
+    png_error(png, "image size doesn't match the rectangle");
+
+  png_set_expand(png);
+  png_set_strip_16(png);
+  png_set_strip_alpha(png);
+  png_set_gray_to_rgb(png);
+
+  if (TightPngIsDirect(state->client, &bgr, &fillerAfter)) {
+    state->direct = TRUE;
+    if (bgr)
+      png_set_bgr(png);
+    png_set_filler(png, 0,
+                   fillerAfter ? PNG_FILLER_AFTER : PNG_FILLER_BEFORE);
+  }
+
+  if (png_set_interlace_handling(png) > 1 && !state->direct) {
+    state->image = malloc((size_t)state->w * state->h * 3);
+    if (state->image == NULL)
+      png_error(png, "memory allocation error");
+  }
+
+  png_read_update_info(png, info);
+}
+
+static void
+PngRowBPP (png_structp png, png_bytep row, png_uint_32 rowNum, int pass)
+{
+  TightPngState *state = png_get_progressive_ptr(png);
+  rfbClient *client = state->client;
+
+  /* Nothing changed in this row during this pass. */
+  if (row == NULL || rowNum >= (png_uint_32)state->h)
+    return;
+
+  if (state->direct)
+    png_progressive_combine_row(png, (png_bytep)&client->frameBuffer[
+        ((state->y + rowNum) * client->width + state->x) * 4], row);
+  else if (state->image)
+    png_progressive_combine_row(png, &state->image[rowNum * state->w * 3],
+                                row);
+  else
+    PngConvertRowBPP(client, row, state->x, state->y + rowNum);
+}
+
+static rfbBool
+DecompressPngRectBPP(rfbClient* client, int x, int y, int w, int h)
+{
+  TightPngState *state;
+  png_structp png;
+  png_infop info;
+  int compressedLen, portionLen, i;
+  volatile rfbBool ok = FALSE;
+
+  compressedLen = (int)ReadCompactLen(client);
+  if (compressedLen <= 0) {
+    rfbClientLog("Incorrect data received from the server.\n");
+    return FALSE;
+  }
+
+  client->rectWidth = w;
+  if (client->frameBufferDownscale > 1 &&
+      !AllocStagingBuffer(client, (size_t)w * (BPP / 8)))
+    return FALSE;
+
+  state = calloc(1, sizeof(*state));
+  if (state == NULL) {
+    rfbClientLog("Memory allocation error.\n");
+    return FALSE;
+  }
+
+  state->client = client;
+  state->x = x;
+  state->y = y;
+  state->w = w;
+  state->h = h;
+
+  png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, TightPngError,
+                               TightPngWarning);
+  info = png ? png_create_info_struct(png) : NULL;
+  if (info == NULL) {
+    rfbClientLog("Failed to initialise libpng.\n");
+    goto done;
+  }
+
+  if (setjmp(png_jmpbuf(png)))
+    goto done;
+
+  png_set_progressive_read_fn(png, state, PngInfoBPP, PngRowBPP, TightPngEnd);
+
+  while (compressedLen > 0) {
+    portionLen = compressedLen > RFB_BUFFER_SIZE ? RFB_BUFFER_SIZE
+                                                 : compressedLen;
+
+    if (!ReadFromRFBServer(client, client->buffer, portionLen))
+      goto done;
+
+    compressedLen -= portionLen;
+    png_process_data(png, info, (png_bytep)client->buffer, portionLen);
+  }
+
+  if (!state->finished) {
+    rfbClientLog("TightPng encoding: incomplete image.\n");
+    goto done;
+  }
+
+  if (state->image)
+    for (i = 0; i < h; i++)
+      PngConvertRowBPP(client, &state->image[i * w * 3], x, y + i);
+
+  ok = TRUE;
+
+done:
+  png_destroy_read_struct(&png, &info, NULL);
+  free(state->image);
+  free(state);
+  return ok;
+}
+
+#endif
+
 #undef CARDBPP
 
 /* LIBVNCSERVER_HAVE_LIBZ and LIBVNCSERVER_HAVE_LIBJPEG */
@@ -56,8 +56,12 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
   int min_buffer_size = 16 * 16 * (REALBPP / 8) * 2;
   uint8_t *buffer;
   CARDBPP palette[128];
-  int bpp = 0, mask = 0, divider = 0;
+  int bpp = 0, divider = 0;
   CARDBPP color = 0;
+  CARDBPP tile[16 * 16];
+  CARDBPP *dst;
+  int stride;
+  rfbBool staged;
 
   /* First make sure we have a large enough raw buffer to hold the
    * decompressed data.  In practice, with a fixed REALBPP, fixed frame
@@ -91,6 +95,16 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
 
       buffer = (uint8_t*)(client->raw_buffer);
 
+      /* Decode into a bounce tile if the framebuffer is downscaled */
+      if (client->frameBufferDownscale > 1) {
+        dst = tile;
+        stride = w;
+      } else {
+        dst = (CARDBPP *)client->frameBuffer + y * client->width + x;
+        stride = client->width;
+      }
+      staged = FALSE;
+
       switch (type) {
       case 0: {
         if (!ReadFromRFBServer(client, (char *)buffer, w * h * REALBPP / 8))
@@ -98,10 +112,10 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
 #if REALBPP != BPP
         int i, j;
 
-        for (j = y * client->width; j < (y + h) * client->width;
-             j += client->width)
-          for (i = x; i < x + w; i++, buffer += REALBPP / 8)
-            ((CARDBPP *)client->frameBuffer)[j + i] = UncompressCPixel(buffer);
+        for (j = 0; j < h; j++)
+          for (i = 0; i < w; i++, buffer += REALBPP / 8)
+            dst[j * stride + i] = UncompressCPixel(buffer);
+        staged = TRUE;
 #else
         client->GotBitmap(client, buffer, x, y, w, h);
 #endif
@@ -136,32 +150,22 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
 
             bpp = (last_type > 4 ? (last_type > 16 ? 8 : 4)
                                  : (last_type > 2 ? 2 : 1)),
-            mask = (1 << bpp) - 1, divider = (8 / bpp);
+            divider = (8 / bpp);
           }
           if (last_type <= 16) {
-            int i, j, shift;
+            int j;
 
             if (!ReadFromRFBServer(client, (char*)buffer,
                                    (w + divider - 1) / divider * h))
               return FALSE;
 
             /* read palettized pixels */
-            for (j = y * client->width; j < (y + h) * client->width;
-                 j += client->width) {
-              for (i = x, shift = 8 - bpp; i < x + w; i++) {
-                ((CARDBPP *)client->frameBuffer)[j + i] =
-                    palette[((*buffer) >> shift) & mask];
-                shift -= bpp;
-                if (shift < 0) {
-                  shift = 8 - bpp;
-                  buffer++;
-                }
-              }
-              if (shift < 8 - bpp)
-                buffer++;
-
-              type = last_type;
-            }
+            for (j = 0; j < h; j++)
+              buffer = UnpackPaletteRowBPP(&dst[j * stride], buffer, w, bpp,
+                                           palette);
+
+            type = last_type;
+            staged = TRUE;
           } else
             return FALSE;
         }
@@ -188,8 +192,7 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
           length += *buffer;
           buffer++;
           while (j < h && length > 0) {
-            ((CARDBPP *)client->frameBuffer)[(y + j) * client->width + x + i] =
-                color;
+            dst[j * stride + i] = color;
             length--;
             i++;
             if (i >= w) {
@@ -200,6 +203,7 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
           if (length > 0)
             rfbClientLog("Warning: possible TRLE corruption\n");
         }
+        staged = TRUE;
 
         type = last_type;
 
@@ -234,8 +238,7 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
           }
           buffer++;
           while (j < h && length > 0) {
-            ((CARDBPP *)client->frameBuffer)[(y + j) * client->width + x + i] =
-                color;
+            dst[j * stride + i] = color;
             length--;
             i++;
             if (i >= w) {
@@ -246,6 +249,7 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
           if (length > 0)
             rfbClientLog("Warning: possible TRLE corruption\n");
         }
+        staged = TRUE;
 
         if (type == 129) {
           type = last_type;
@@ -258,7 +262,7 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
           int i;
 
           bpp = (type > 4 ? 4 : (type > 2 ? 2 : 1)),
-          mask = (1 << bpp) - 1, divider = (8 / bpp);
+          divider = (8 / bpp);
 
           if (!ReadFromRFBServer(client, (char *)buffer, type * REALBPP / 8))
             return FALSE;
@@ -284,6 +288,9 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
         } else
           return FALSE;
       }
+      if (staged && dst == tile)
+        client->GotBitmap(client, (uint8_t *)tile, x, y, w, h);
+
       last_type = type;
     }
   }
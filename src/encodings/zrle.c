@@ -239,6 +239,10 @@ static int HandleZRLETile(rfbClient* client,
 	uint8_t* buffer_copy = buffer;
 	uint8_t* buffer_end = buffer+buffer_length;
 	uint8_t type;
+	CARDBPP tile[rfbZRLETileWidth*rfbZRLETileHeight];
+	CARDBPP* dst = (CARDBPP*)client->frameBuffer + y*client->width+x;
+	int stride = client->width;
+	rfbBool staged = FALSE;
 #if BPP!=8
 	uint8_t zywrle_level = (client->appData.qualityLevel & 0x80) ?
 		0 : (3 - client->appData.qualityLevel / 3);
@@ -247,6 +251,12 @@ static int HandleZRLETile(rfbClient* client,
 	if(buffer_length<1)
 		return -2;
 
+	/* Decode into a bounce tile if the framebuffer is downscaled */
+	if(client->frameBufferDownscale>1) {
+		dst = tile;
+		stride = w;
+	}
+
 	type = *buffer;
 	buffer++;
 	{
@@ -274,9 +284,10 @@ static int HandleZRLETile(rfbClient* client,
 				return -3;
 			}
 
-			for(j=y*client->width; j<(y+h)*client->width; j+=client->width)
-				for(i=x; i<x+w; i++,buffer+=REALBPP/8)
-					((CARDBPP*)client->frameBuffer)[j+i] = UncompressCPixel(buffer);
+			for(j=0; j<h; j++)
+				for(i=0; i<w; i++,buffer+=REALBPP/8)
+					dst[j*stride+i] = UncompressCPixel(buffer);
+			staged = TRUE;
 #else
 			client->GotBitmap(client, buffer, x, y, w, h);
 			buffer+=w*h*REALBPP/8;
@@ -297,9 +308,8 @@ static int HandleZRLETile(rfbClient* client,
 		else if( type <= 127 ) /* packed Palette */
 		{
 			CARDBPP palette[128];
-			int i,j,shift,
+			int i,j,
 				bpp=(type>4?(type>16?8:4):(type>2?2:1)),
-				mask=(1<<bpp)-1,
 				divider=(8/bpp);
 
 			if(1+type*REALBPP/8+((w+divider-1)/divider)*h>buffer_length)
@@ -310,18 +320,9 @@ static int HandleZRLETile(rfbClient* client,
 				palette[i] = UncompressCPixel(buffer);
 
 			/* read palettized pixels */
-			for(j=y*client->width; j<(y+h)*client->width; j+=client->width) {
-				for(i=x,shift=8-bpp; i<x+w; i++) {
-					((CARDBPP*)client->frameBuffer)[j+i] = palette[((*buffer)>>shift)&mask];
-					shift-=bpp;
-					if(shift<0) {
-						shift=8-bpp;
-						buffer++;
-					}
-				}
-				if(shift<8-bpp)
-					buffer++;
-			}
+			for(j=0; j<h; j++)
+				buffer = UnpackPaletteRowBPP(&dst[j*stride], buffer, w, bpp, palette);
+			staged = TRUE;
 
 		}
 		/* case 17 ... 127: not used, but valid */
@@ -346,7 +347,7 @@ static int HandleZRLETile(rfbClient* client,
 				length+=*buffer;
 				buffer++;
 				while(j<h && length>0) {
-					((CARDBPP*)client->frameBuffer)[(y+j)*client->width+x+i] = color;
+					dst[j*stride+i] = color;
 					length--;
 					i++;
 					if(i>=w) {
@@ -357,6 +358,7 @@ static int HandleZRLETile(rfbClient* client,
 				if(length>0)
 					rfbClientLog("Warning: possible ZRLE corruption\n");
 			}
+			staged = TRUE;
 
 		}
 		else if( type == 129 ) /* unused */
@@ -398,7 +400,7 @@ static int HandleZRLETile(rfbClient* client,
 				}
 				buffer++;
 				while(j<h && length>0) {
-					((CARDBPP*)client->frameBuffer)[(y+j)*client->width+x+i] = color;
+					dst[j*stride+i] = color;
 					length--;
 					i++;
 					if(i>=w) {
@@ -409,9 +411,13 @@ static int HandleZRLETile(rfbClient* client,
 				if(length>0)
 					rfbClientLog("Warning: possible ZRLE corruption\n");
 			}
+			staged = TRUE;
 		}
 	}
 
+	if(staged && dst==tile)
+		client->GotBitmap(client, (uint8_t*)tile, x, y, w, h);
+
 	return buffer-buffer_copy;	
 }
 
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "jpeg-pool.h"
+#include "work-pool.h"
+#include "turbojpeg.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/* Decompressors aren't thread safe, so each worker of the pool has its own.
+ * They are only touched by their worker, and by jpeg_pool_finish() once the
+ * pool is idle.
+ */
+static tjhandle tjhnds[WORK_POOL_MAX_THREADS + 1];
+
+static void jpeg_job_run(void* userdata, int worker)
+{
+	struct jpeg_job* job = userdata;
+
+	if (!tjhnds[worker])
+		tjhnds[worker] = tjInitDecompress();
+
+	tjhandle tjhnd = tjhnds[worker];
+	if (!tjhnd) {
+		job->result = -1;
+		return;
+	}
+
+	if (job->dst)
+		job->result = tjDecompress(tjhnd, job->data, job->length,
+				job->dst, job->width, job->pitch, job->height,
+				4, job->flags);
+	else
+		job->result = tjDecompressToYUVPlanes(tjhnd, job->data,
+				job->length, job->planes, job->width,
+				job->strides, job->height, job->flags);
+}
+
+void jpeg_pool_finish(void)
+{
+	work_pool_wait();
+
+	for (int i = 0; i <= WORK_POOL_MAX_THREADS; ++i) {
+		if (tjhnds[i])
+			tjDestroy(tjhnds[i]);
+		tjhnds[i] = NULL;
+	}
+}
+
+void jpeg_pool_submit(struct jpeg_job* job)
+{
+	work_pool_submit(jpeg_job_run, job);
+}
+
+void jpeg_pool_wait(void)
+{
+	work_pool_wait();
+}
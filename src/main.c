@@ -31,6 +31,7 @@
 #include <gbm.h>
 #include <xf86drm.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 
 #include "pixman.h"
 #include "xdg-shell.h"
@@ -44,7 +45,14 @@
 #include "buffer.h"
 #include "renderer.h"
 #include "renderer-egl.h"
+#include "work-pool.h"
 #include "linux-dmabuf-unstable-v1.h"
+#include "dmabuf-feedback.h"
+#include "linux-drm-syncobj-v1.h"
+#include "sync-timeline.h"
+#include "viewporter.h"
+#include "single-pixel-buffer-v1.h"
+#include "fractional-scale-v1.h"
 #include "time-util.h"
 #include "output.h"
 #include "data-control.h"
@@ -52,6 +60,36 @@
 #define CANARY_TICK_PERIOD INT64_C(100000) // us
 #define CANARY_LETHALITY_LEVEL INT64_C(8000) // us
 
+// Extra pixels around the viewport that are kept up to date by the server
+#define VIEWPORT_UPDATE_MARGIN 64
+// Rows further than this away from the viewport are released
+#define VIEWPORT_CACHE_MARGIN 1024
+#define VIEWPORT_SCROLL_STEP 64.0
+#define VIEWPORT_DEFAULT_WIDTH 1280
+#define VIEWPORT_DEFAULT_HEIGHT 720
+
+#define CONFIGURE_SETTLE_DELAY INT64_C(200000) // us
+#define FRAME_CALLBACK_TIMEOUT INT64_C(1000000) // us
+#define SERVER_SCALE_MAX 8
+// Granularity of buffers that are allowed to be larger than the window
+#define BUFFER_SIZE_STEP 256
+
+#define MIN_BUFFERS 2
+#define MAX_BUFFERS 4
+#define DEFAULT_BUFFERS 3
+// Frames over which buffer use is observed before the swapchain shrinks
+#define SWAPCHAIN_SHRINK_FRAMES 300
+#define DAMAGE_HISTORY_LENGTH 8
+
+// TightPng is only understood when built with libpng
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+#define TIGHTPNG_ENCODING "tightpng,"
+#define TIGHTPNG_HELP "tightpng, "
+#else
+#define TIGHTPNG_ENCODING ""
+#define TIGHTPNG_HELP ""
+#endif
+
 struct point {
 	double x, y;
 };
@@ -61,16 +99,86 @@ struct window {
 	struct xdg_surface* xdg_surface;
 	struct xdg_toplevel* xdg_toplevel;
 
-	struct buffer* buffers[3];
+	struct buffer* buffers[MAX_BUFFERS];
+	int n_buffers;
 	struct buffer* back_buffer;
-	int buffer_index;
+	// Part of the buffers that is shown, which may be smaller than them
+	int buffer_width, buffer_height;
+
+	struct pixman_region32 current_damage;
+
+	/* Buffer damage of recent frames. Buffers are brought up to date with
+	 * the frames that were rendered since their own last one.
+	 */
+	struct pixman_region32 damage_history[DAMAGE_HISTORY_LENGTH];
+	uint64_t frame;
+
+	// Most buffers that the compositor has held at once, recently
+	int max_buffers_in_use;
+	int n_swaps_observed;
 
-	struct pixman_region16 current_damage;
+	/* Damage that renderers need to take from the framebuffer, as opposed
+	 * to what they can copy from their own previous frame.
+	 */
+	struct pixman_region32 upload_damage;
+	struct vnc_copy_rect copy_rects[VNC_CLIENT_MAX_COPY_RECTS];
+	int n_copy_rects;
+	struct pixman_region32 copy_damage;
 
 	struct vnc_client* vnc;
 	void* vnc_fb;
+	size_t vnc_fb_size;
+	// The framebuffer is the back buffer itself
+	bool is_fb_in_buffer;
+
+	// Top left corner of the viewport in remote framebuffer coordinates
+	struct point view;
+	bool is_panning;
+	struct point pan_origin;
+	enum pointer_button_mask pointer_buttons;
+
+	// Remote desktop size that matches the window, in buffer pixels
+	int desktop_width, desktop_height;
+	int requested_desktop_width, requested_desktop_height;
 
 	bool is_frame_committed;
+	bool is_configured;
+
+	/* With wp_viewporter, the remote framebuffer is shown on a sub-surface
+	 * using buffers of its own size and the compositor does the scaling.
+	 * The main surface only carries a black pixel stretched over the whole
+	 * window, which makes up the letterbox bars.
+	 */
+	struct wl_surface* content_surface;
+	struct wl_subsurface* content_subsurface;
+	struct wp_viewport* content_viewport;
+	struct wl_buffer* background_pixel;
+	struct buffer* background_shm;
+
+	/* Viewport of the main surface. Besides stretching the background, it
+	 * lets buffers be allocated at a fractional scale.
+	 */
+	struct wp_viewport* viewport;
+	struct wp_fractional_scale_v1* fractional_scale;
+	// Zero until the compositor suggests a scale
+	double preferred_scale;
+
+	// Set on the surface that buffers are attached to, with explicit sync
+	struct wp_linux_drm_syncobj_surface_v1* syncobj_surface;
+
+	// Per-surface preferences for dmabuf allocation
+	struct dmabuf_feedback* dmabuf_feedback;
+
+	// Window size and content placement in surface coordinates
+	int width, height;
+	int content_x, content_y;
+	double content_scale;
+
+	/* Updates are paused while the compositor says that the window is
+	 * suspended or while it withholds frame callbacks.
+	 */
+	bool is_suspended;
+	bool is_frame_overdue;
 };
 
 static void register_frame_callback(void);
@@ -82,6 +190,12 @@ struct wl_shm* wl_shm = NULL;
 struct zwp_linux_dmabuf_v1* zwp_linux_dmabuf_v1 = NULL;
 struct gbm_device* gbm_device = NULL;
 static struct xdg_wm_base* xdg_wm_base;
+static struct wl_subcompositor* wl_subcompositor;
+static struct wp_viewporter* wp_viewporter;
+static struct wp_single_pixel_buffer_manager_v1* single_pixel_manager;
+static struct wp_fractional_scale_manager_v1* fractional_scale_manager;
+// Only kept if explicit sync can be used
+static struct wp_linux_drm_syncobj_manager_v1* syncobj_manager;
 static struct wl_list seats;
 static struct wl_list outputs;
 struct pointer_collection* pointers;
@@ -96,9 +210,22 @@ static bool have_egl = false;
 
 static uint32_t shm_format = DRM_FORMAT_INVALID;
 static uint32_t dmabuf_format = DRM_FORMAT_INVALID;
+// Modifiers negotiated through dmabuf feedback; empty means implicit
+static uint64_t* dmabuf_modifiers = NULL;
+static int n_dmabuf_modifiers = 0;
+static bool dmabuf_scanout = false;
 
 static bool do_run = true;
 
+// Zero means that the remote desktop is fitted to the window
+static double viewport_zoom = 0.0;
+
+static bool use_remote_resize = false;
+static bool use_server_scale = false;
+static struct aml_timer* configure_timer;
+static bool is_configure_pending = false;
+static struct aml_timer* frame_timer;
+
 struct window* window = NULL;
 const char* app_id = "wlvncc";
 
@@ -133,12 +260,32 @@ static void registry_add(void* data, struct wl_registry* registry, uint32_t id,
 		wl_compositor = wl_registry_bind(registry, id,
 				&wl_compositor_interface, 4);
 	} else if (strcmp(interface, "xdg_wm_base") == 0) {
-		xdg_wm_base = wl_registry_bind(registry, id, &xdg_wm_base_interface, 1);
+		xdg_wm_base = wl_registry_bind(registry, id, &xdg_wm_base_interface,
+				version < 6 ? version : 6);
+	} else if (strcmp(interface, wl_subcompositor_interface.name) == 0) {
+		wl_subcompositor = wl_registry_bind(registry, id,
+				&wl_subcompositor_interface, 1);
+	} else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+		wp_viewporter = wl_registry_bind(registry, id,
+				&wp_viewporter_interface, 1);
+	} else if (strcmp(interface,
+				wp_single_pixel_buffer_manager_v1_interface.name) == 0) {
+		single_pixel_manager = wl_registry_bind(registry, id,
+				&wp_single_pixel_buffer_manager_v1_interface, 1);
+	} else if (strcmp(interface,
+				wp_fractional_scale_manager_v1_interface.name) == 0) {
+		fractional_scale_manager = wl_registry_bind(registry, id,
+				&wp_fractional_scale_manager_v1_interface, 1);
+	} else if (strcmp(interface,
+				wp_linux_drm_syncobj_manager_v1_interface.name) == 0) {
+		syncobj_manager = wl_registry_bind(registry, id,
+				&wp_linux_drm_syncobj_manager_v1_interface, 1);
 	} else if (strcmp(interface, "wl_shm") == 0) {
 		wl_shm = wl_registry_bind(registry, id, &wl_shm_interface, 1);
 	} else if (strcmp(interface, "zwp_linux_dmabuf_v1") == 0) {
 		zwp_linux_dmabuf_v1 = wl_registry_bind(registry, id,
-				&zwp_linux_dmabuf_v1_interface, 2);
+				&zwp_linux_dmabuf_v1_interface,
+				version < 4 ? version : 4);
 	} else if (strcmp(interface, "wl_seat") == 0) {
 		struct wl_seat* wl_seat;
 		wl_seat = wl_registry_bind(registry, id, &wl_seat_interface, 5);
@@ -281,17 +428,34 @@ static int init_signal_handler(void)
 	return rc;
 }
 
+static struct wl_surface* window_buffer_surface(struct window* w)
+{
+	return w->content_surface ? w->content_surface : w->wl_surface;
+}
+
 static void window_attach(struct window* w, int x, int y)
 {
+	struct wl_surface* surface = window_buffer_surface(w);
+
 	w->back_buffer->is_attached = true;
-	wl_surface_attach(w->wl_surface, w->back_buffer->wl_buffer, x, y);
-	wl_surface_set_buffer_scale(window->wl_surface,
-			window->back_buffer->scale);
+	wl_surface_attach(surface, w->back_buffer->wl_buffer, x, y);
+	wl_surface_set_buffer_scale(surface, w->back_buffer->scale);
+}
+
+/* The compositor's preferred fractional scale, falling back to the integer
+ * scale of the outputs.
+ */
+static double window_get_scale(const struct window* w)
+{
+	if (w && w->preferred_scale > 0.0)
+		return w->preferred_scale;
+
+	return output_list_get_max_scale(&outputs);
 }
 
 static struct point surface_coord_to_buffer_coord(double x, double y)
 {
-	double scale = output_list_get_max_scale(&outputs);
+	double scale = window_get_scale(window);
 
 	struct point result = {
 		.x = round(x * scale),
@@ -303,7 +467,7 @@ static struct point surface_coord_to_buffer_coord(double x, double y)
 
 static struct point buffer_coord_to_surface_coord(double x, double y)
 {
-	double scale = output_list_get_max_scale(&outputs);
+	double scale = window_get_scale(window);
 
 	struct point result = {
 		.x = x / scale,
@@ -313,13 +477,38 @@ static struct point buffer_coord_to_surface_coord(double x, double y)
 	return result;
 }
 
+static int viewport_offset(double dst_size, double src_size, double view_pos)
+{
+	if (src_size <= dst_size)
+		return round(dst_size / 2.0 - src_size / 2.0);
+
+	return -round(view_pos);
+}
+
 static void window_calculate_transform(struct window* w, double* scale,
 		int* x_pos, int* y_pos)
 {
+	// The compositor takes care of placing and scaling the content surface
+	if (w->content_surface) {
+		*scale = 1.0;
+		*x_pos = 0;
+		*y_pos = 0;
+		return;
+	}
+
 	double src_width = vnc_client_get_width(w->vnc);
 	double src_height = vnc_client_get_height(w->vnc);
-	double dst_width = w->back_buffer->width;
-	double dst_height = w->back_buffer->height;
+	double dst_width = w->buffer_width;
+	double dst_height = w->buffer_height;
+
+	if (viewport_zoom > 0.0) {
+		*scale = viewport_zoom;
+		*x_pos = viewport_offset(dst_width, src_width * *scale,
+				w->view.x * *scale);
+		*y_pos = viewport_offset(dst_height, src_height * *scale,
+				w->view.y * *scale);
+		return;
+	}
 
 	double hratio = (double)dst_width / (double)src_width;
 	double vratio = (double)dst_height / (double)src_height;
@@ -337,6 +526,91 @@ static void window_calculate_transform(struct window* w, double* scale,
 	}
 }
 
+static void window_get_visible_rect(struct window* w,
+		struct pixman_box32* box)
+{
+	double scale;
+	int x_pos, y_pos;
+	window_calculate_transform(w, &scale, &x_pos, &y_pos);
+
+	double src_width = vnc_client_get_width(w->vnc);
+	double src_height = vnc_client_get_height(w->vnc);
+	double dst_width = w->buffer_width;
+	double dst_height = w->buffer_height;
+
+	box->x1 = fmax(0.0, floor(-x_pos / scale));
+	box->y1 = fmax(0.0, floor(-y_pos / scale));
+	box->x2 = fmin(src_width, ceil((dst_width - x_pos) / scale));
+	box->y2 = fmin(src_height, ceil((dst_height - y_pos) / scale));
+}
+
+static void discard_pages(uint8_t* start, uint8_t* end)
+{
+	uintptr_t page_size = sysconf(_SC_PAGESIZE);
+	uintptr_t first = ((uintptr_t)start + page_size - 1) & ~(page_size - 1);
+	uintptr_t last = (uintptr_t)end & ~(page_size - 1);
+
+	if (first < last)
+		madvise((void*)first, last - first, MADV_DONTNEED);
+}
+
+/* Rows that are far away from the viewport are outside of the update
+ * rectangle, so they're stale anyway. Give their memory back to the system.
+ * They will be requested again in full if they come back into view.
+ */
+static void window_discard_fb_rows(struct window* w, int keep_y1,
+		int keep_y2)
+{
+	uint8_t* fb = w->vnc_fb;
+	int stride = vnc_client_get_stride(w->vnc);
+	int height = vnc_client_get_height(w->vnc);
+
+	if (keep_y1 > 0)
+		discard_pages(fb, fb + keep_y1 * stride);
+
+	if (keep_y2 < height)
+		discard_pages(fb + keep_y2 * stride, fb + height * stride);
+}
+
+static void window_clamp_view(struct window* w)
+{
+	double scale = viewport_zoom;
+	double max_x = vnc_client_get_width(w->vnc) -
+		w->buffer_width / scale;
+	double max_y = vnc_client_get_height(w->vnc) -
+		w->buffer_height / scale;
+
+	w->view.x = fmax(0.0, fmin(w->view.x, max_x));
+	w->view.y = fmax(0.0, fmin(w->view.y, max_y));
+}
+
+static void window_update_viewport(struct window* w)
+{
+	if (viewport_zoom <= 0.0)
+		return;
+
+	window_clamp_view(w);
+
+	struct pixman_box32 box;
+	window_get_visible_rect(w, &box);
+
+	vnc_client_set_update_rect(w->vnc,
+			box.x1 - VIEWPORT_UPDATE_MARGIN,
+			box.y1 - VIEWPORT_UPDATE_MARGIN,
+			box.x2 - box.x1 + 2 * VIEWPORT_UPDATE_MARGIN,
+			box.y2 - box.y1 + 2 * VIEWPORT_UPDATE_MARGIN);
+
+	window_discard_fb_rows(w, box.y1 - VIEWPORT_CACHE_MARGIN,
+			box.y2 + VIEWPORT_CACHE_MARGIN);
+}
+
+static void window_resolve_yuv_rect(struct vnc_jpeg_rect* rect,
+		void* userdata)
+{
+	struct window* w = userdata;
+	vnc_client_resolve_yuv_rect(w->vnc, rect);
+}
+
 static void window_transfer_pixels(struct window* w)
 {
 	double scale;
@@ -351,6 +625,18 @@ static void window_transfer_pixels(struct window* w)
 		return;
 	}
 
+	// Updates have already been decoded into the buffer
+	if (w->is_fb_in_buffer) {
+		pixman_region32_clear(&w->back_buffer->damage);
+		return;
+	}
+
+	/* The renderer converts those from YUV instead, or has them resolved
+	 * through window_resolve_yuv_rect() and uploads them itself.
+	 */
+	pixman_region32_subtract(&w->upload_damage, &w->upload_damage,
+			&w->vnc->stale_region);
+
 	struct image image = {
 		.pixels = w->vnc_fb,
 		.width = vnc_client_get_width(w->vnc),
@@ -358,7 +644,15 @@ static void window_transfer_pixels(struct window* w)
 		.stride = vnc_client_get_stride(w->vnc),
 		// TODO: Get the format from the vnc module
 		.format = w->back_buffer->format,
-		.damage = &w->current_damage,
+		.damage = &w->upload_damage,
+		.copy_rects = w->copy_rects,
+		.n_copy_rects = w->n_copy_rects,
+		.copy_damage = &w->copy_damage,
+		.yuv_rects = w->vnc->yuv_rects,
+		.n_yuv_rects = w->vnc->n_yuv_rects,
+		.stale = &w->vnc->stale_region,
+		.resolve_yuv_rect = window_resolve_yuv_rect,
+		.userdata = w,
 	};
 
 	if (have_egl)
@@ -369,23 +663,280 @@ static void window_transfer_pixels(struct window* w)
 
 static void window_commit(struct window* w)
 {
-	wl_surface_commit(w->wl_surface);
+	struct buffer* buffer = w->back_buffer;
+
+	if (w->syncobj_surface) {
+		struct wp_linux_drm_syncobj_timeline_v1* timeline =
+			buffer->timeline->wl_timeline;
+
+		wp_linux_drm_syncobj_surface_v1_set_acquire_point(
+				w->syncobj_surface, timeline,
+				buffer->acquire_point >> 32,
+				buffer->acquire_point & 0xffffffff);
+		wp_linux_drm_syncobj_surface_v1_set_release_point(
+				w->syncobj_surface, timeline,
+				buffer->release_point >> 32,
+				buffer->release_point & 0xffffffff);
+	}
+
+	wl_surface_commit(window_buffer_surface(w));
+}
+
+/* Adds whatever has changed since the buffer was last rendered to its damage.
+ */
+static void window_age_buffer_damage(struct window* w, struct buffer* buffer)
+{
+	struct pixman_region32* damage = &buffer->damage;
+
+	if (buffer->frame == 0 ||
+			w->frame - buffer->frame >= DAMAGE_HISTORY_LENGTH) {
+		pixman_region32_union_rect(damage, damage, 0, 0, buffer->width,
+				buffer->height);
+	} else {
+		for (uint64_t f = buffer->frame + 1; f <= w->frame; ++f)
+			pixman_region32_union(damage, damage,
+					&w->damage_history[f %
+					DAMAGE_HISTORY_LENGTH]);
+	}
+
+	buffer->frame = w->frame;
+}
+
+/* Brings the new back buffer up to date by copying whatever has changed since
+ * it was last presented from the buffer that was presented most recently, and
+ * makes it the target for decoding.
+ */
+static void window_sync_back_buffer(struct window* w, struct buffer* src)
+{
+	struct buffer* dst = w->back_buffer;
+	window_age_buffer_damage(w, dst);
+
+	struct pixman_region32 damage;
+	pixman_region32_init(&damage);
+	pixman_region32_copy(&damage, &dst->damage);
+
+	// Parts of an update that is still being decoded aren't tracked yet
+	if (w->vnc->is_updating)
+		dirty_tiles_to_region(&w->vnc->damage, &damage);
+
+	pixman_region32_intersect_rect(&damage, &damage, 0, 0, dst->width,
+			dst->height);
+
+	int n_rects = 0;
+	struct pixman_box32* box = pixman_region32_rectangles(&damage, &n_rects);
+
+	for (int i = 0; i < n_rects; ++i) {
+		size_t offset = box[i].x1 * 4;
+		size_t len = (box[i].x2 - box[i].x1) * 4;
+
+		for (int y = box[i].y1; y < box[i].y2; ++y)
+			memcpy((uint8_t*)dst->pixels + y * dst->stride + offset,
+					(uint8_t*)src->pixels + y * src->stride +
+					offset, len);
+	}
+
+	pixman_region32_fini(&damage);
+	pixman_region32_clear(&dst->damage);
+
+	w->vnc_fb = dst->pixels;
+	vnc_client_set_fb(w->vnc, w->vnc_fb);
 }
 
+static struct buffer* window_create_buffer(int width, int height, int scale)
+{
+	struct buffer* buffer = have_egl
+		? buffer_create_dmabuf(width, height, dmabuf_format,
+				dmabuf_modifiers, n_dmabuf_modifiers,
+				dmabuf_scanout)
+		: buffer_create_shm(width, height, 4 * width, shm_format);
+	if (!buffer)
+		return NULL;
+
+	buffer->scale = scale;
+
+	if (syncobj_manager) {
+		buffer->timeline = sync_timeline_create(drm_fd,
+				syncobj_manager);
+		if (!buffer->timeline) {
+			buffer_destroy(buffer);
+			return NULL;
+		}
+	}
+
+	return buffer;
+}
+
+// Picks the buffer that has gone the longest without being rendered to
+static struct buffer* window_oldest_buffer(struct window* w,
+		const struct buffer* front, bool may_be_attached)
+{
+	struct buffer* oldest = NULL;
+
+	for (int i = 0; i < w->n_buffers; ++i) {
+		struct buffer* buffer = w->buffers[i];
+
+		if (buffer == front || (buffer->is_attached && !may_be_attached))
+			continue;
+
+		if (!oldest || buffer->frame < oldest->frame)
+			oldest = buffer;
+	}
+
+	return oldest;
+}
+
+/* Of the buffers that the compositor still holds, picks the oldest one that it
+ * has attached a release fence to, so that drawing into it only needs to wait
+ * on the GPU.
+ */
+static struct buffer* window_oldest_releasing_buffer(struct window* w,
+		const struct buffer* front)
+{
+	struct buffer* oldest = NULL;
+
+	for (int i = 0; i < w->n_buffers; ++i) {
+		struct buffer* buffer = w->buffers[i];
+
+		if (buffer == front || !buffer_is_release_available(buffer))
+			continue;
+
+		if (!oldest || buffer->frame < oldest->frame)
+			oldest = buffer;
+	}
+
+	return oldest;
+}
+
+/* If the compositor has held on to fewer buffers than there are for a while,
+ * one of them is let go. One more than it holds is enough to always have a
+ * free buffer.
+ */
+static void window_observe_buffer_use(struct window* w, struct buffer* front)
+{
+	int n_in_use = 0;
+	for (int i = 0; i < w->n_buffers; ++i)
+		if (w->buffers[i]->is_attached)
+			++n_in_use;
+
+	if (n_in_use > w->max_buffers_in_use)
+		w->max_buffers_in_use = n_in_use;
+
+	if (++w->n_swaps_observed < SWAPCHAIN_SHRINK_FRAMES)
+		return;
+
+	struct buffer* spare = window_oldest_buffer(w, front, false);
+	if (spare && w->n_buffers > MIN_BUFFERS &&
+			w->max_buffers_in_use + 1 < w->n_buffers) {
+		int i = 0;
+		while (w->buffers[i] != spare)
+			++i;
+
+		memmove(&w->buffers[i], &w->buffers[i + 1],
+				(w->n_buffers - i - 1) * sizeof(*w->buffers));
+		w->buffers[--w->n_buffers] = NULL;
+		buffer_destroy(spare);
+	}
+
+	w->n_swaps_observed = 0;
+	w->max_buffers_in_use = 0;
+}
+
+/* The next back buffer is the free one that has gone unused the longest. If
+ * the compositor holds on to all of them, the swapchain grows instead of
+ * drawing into a buffer that may still be on screen.
+ */
 static void window_swap(struct window* w)
 {
-	w->buffer_index = (w->buffer_index + 1) % 3;
-	w->back_buffer = w->buffers[w->buffer_index];
+	struct buffer* front = w->back_buffer;
+
+	for (int i = 0; i < w->n_buffers; ++i)
+		buffer_poll_release(w->buffers[i]);
+
+	window_observe_buffer_use(w, front);
+
+	struct buffer* back = window_oldest_buffer(w, front, false);
+
+	if (!back && w->n_buffers < MAX_BUFFERS) {
+		back = window_create_buffer(front->width, front->height,
+				front->scale);
+		if (back)
+			w->buffers[w->n_buffers++] = back;
+	}
+
+	if (!back)
+		back = window_oldest_releasing_buffer(w, front);
+
+	if (!back)
+		back = window_oldest_buffer(w, front, true);
+
+	// Only one buffer could be created, so it is drawn into again
+	if (!back)
+		return;
+
+	w->back_buffer = back;
+
+	if (w->is_fb_in_buffer)
+		window_sync_back_buffer(w, front);
 }
 
 static void window_damage(struct window* w, int x, int y, int width, int height)
 {
-	wl_surface_damage(w->wl_surface, x, y, width, height);
+	if (w->viewport)
+		wl_surface_damage_buffer(window_buffer_surface(w), x, y, width,
+				height);
+	else
+		wl_surface_damage(w->wl_surface, x, y, width, height);
+}
+
+/* Fits the content surface into the window. The new state is applied on the
+ * next commit of the main surface.
+ */
+static void window_layout_content(struct window* w)
+{
+	if (!w->content_surface || !w->vnc || !w->width || !w->height)
+		return;
+
+	double src_width = vnc_client_get_width(w->vnc);
+	double src_height = vnc_client_get_height(w->vnc);
+	double scale = fmin(w->width / src_width, w->height / src_height);
+
+	int width = fmax(1.0, round(src_width * scale));
+	int height = fmax(1.0, round(src_height * scale));
+
+	w->content_scale = scale;
+	w->content_x = round((w->width - width) / 2.0);
+	w->content_y = round((w->height - height) / 2.0);
+
+	wp_viewport_set_destination(w->viewport, w->width,
+			w->height);
+	wl_subsurface_set_position(w->content_subsurface, w->content_x,
+			w->content_y);
+	wp_viewport_set_destination(w->content_viewport, width, height);
+}
+
+static void window_commit_layout(struct window* w)
+{
+	if (!w->content_surface || !w->width || !w->height)
+		return;
+
+	wl_surface_attach(w->wl_surface, w->background_pixel, 0, 0);
+	wl_surface_damage_buffer(w->wl_surface, 0, 0, 1, 1);
+
+	// The sub-surface is desynchronised, so this applies its viewport
+	wl_surface_commit(w->content_surface);
+	wl_surface_commit(w->wl_surface);
 }
 
+static void render_from_vnc(void);
+
 static void window_configure(struct window* w)
 {
-	// What to do here?
+	w->is_configured = true;
+	window_commit_layout(w);
+
+	// Buffers may have been reallocated, along with the viewport
+	if (!w->content_surface && w->viewport && w->vnc_fb)
+		render_from_vnc();
 }
 
 static void xdg_surface_configure(void* data, struct xdg_surface* surface,
@@ -400,36 +951,215 @@ static const struct xdg_surface_listener xdg_surface_listener = {
 	.configure = xdg_surface_configure,
 };
 
-static void window_resize(struct window* w, int width, int height, int scale)
+static void window_realloc_buffers(struct window* w, int width, int height,
+		int scale)
+{
+	for (int i = 0; i < w->n_buffers; ++i)
+		buffer_destroy(w->buffers[i]);
+
+	// The swapchain makes do with the buffers that could be created
+	int n_buffers = 0;
+	for (int i = 0; i < w->n_buffers; ++i) {
+		struct buffer* buffer = window_create_buffer(width, height,
+				scale);
+		if (buffer)
+			w->buffers[n_buffers++] = buffer;
+	}
+
+	for (int i = n_buffers; i < w->n_buffers; ++i)
+		w->buffers[i] = NULL;
+
+	if (n_buffers == 0) {
+		fprintf(stderr, "Failed to allocate buffers\n");
+		abort();
+	}
+
+	w->n_buffers = n_buffers;
+	w->back_buffer = w->buffers[0];
+	w->buffer_width = width;
+	w->buffer_height = height;
+}
+
+/* Buffers that are shown through a viewport may be larger than needed, so
+ * they are only replaced once the window outgrows them or they have become
+ * much too large. This keeps interactive resizing from allocating new buffers
+ * on every configure, while the waste stays bounded.
+ */
+static bool window_buffers_fit(struct window* w, int width, int height,
+		int scale)
+{
+	struct buffer* buffer = w->back_buffer;
+
+	if (!buffer || buffer->scale != scale)
+		return false;
+
+	if (!w->viewport)
+		return buffer->width == width && buffer->height == height;
+
+	return buffer->width >= width && buffer->height >= height &&
+		buffer->width - width < 2 * BUFFER_SIZE_STEP &&
+		buffer->height - height < 2 * BUFFER_SIZE_STEP;
+}
+
+static void window_resize(struct window* w, int width, int height,
+		double scale)
 {
 	if (width == 0 || height == 0 || scale == 0)
 		return;
 
-	if (w->back_buffer && w->back_buffer->width == width &&
-			w->back_buffer->height == height &&
-			w->back_buffer->scale == scale)
+	w->width = width;
+	w->height = height;
+
+	// Content buffers follow the framebuffer size instead of the window's
+	if (w->content_surface) {
+		window_layout_content(w);
 		return;
+	}
 
-	for (int i = 0; i < 3; ++i)
-		buffer_destroy(w->buffers[i]);
+	/* With a viewport, buffers can have any size and the compositor maps
+	 * them onto the surface. Otherwise, only integer scales are possible.
+	 */
+	int buffer_scale = 1;
+	int buffer_width, buffer_height;
+	if (w->viewport) {
+		buffer_width = round(width * scale);
+		buffer_height = round(height * scale);
+		wp_viewport_set_destination(w->viewport, width, height);
+	} else {
+		buffer_scale = scale;
+		buffer_width = width * buffer_scale;
+		buffer_height = height * buffer_scale;
+	}
+
+	if (w->buffer_width == buffer_width &&
+			w->buffer_height == buffer_height &&
+			window_buffers_fit(w, buffer_width, buffer_height,
+				buffer_scale))
+		return;
 
-	for (int i = 0; i < 3; ++i) {
-		w->buffers[i] = have_egl
-			? buffer_create_dmabuf(scale * width, scale * height,
-					dmabuf_format)
-			: buffer_create_shm(scale * width, scale * height,
-					scale * 4 * width, shm_format);
-		w->buffers[i]->scale = scale;
+	if (!window_buffers_fit(w, buffer_width, buffer_height, buffer_scale)) {
+		int alloc_width = buffer_width;
+		int alloc_height = buffer_height;
+
+		if (w->viewport) {
+			alloc_width = (buffer_width / BUFFER_SIZE_STEP + 1) *
+				BUFFER_SIZE_STEP;
+			alloc_height = (buffer_height / BUFFER_SIZE_STEP + 1) *
+				BUFFER_SIZE_STEP;
+		}
+
+		window_realloc_buffers(w, alloc_width, alloc_height,
+				buffer_scale);
 	}
 
-	w->back_buffer = w->buffers[0];
+	w->buffer_width = buffer_width;
+	w->buffer_height = buffer_height;
+
+	if (w->viewport)
+		wp_viewport_set_source(w->viewport, 0, 0,
+				wl_fixed_from_int(buffer_width),
+				wl_fixed_from_int(buffer_height));
+
+	// The layout has changed, so everything must be redrawn
+	for (int i = 0; i < w->n_buffers; ++i)
+		w->buffers[i]->frame = 0;
+
+	if (w->vnc_fb)
+		pixman_region32_union_rect(&w->current_damage,
+				&w->current_damage, 0, 0,
+				vnc_client_get_width(w->vnc),
+				vnc_client_get_height(w->vnc));
+}
+
+static void window_request_desktop_size(struct window* w)
+{
+	if (w->desktop_width == w->requested_desktop_width &&
+			w->desktop_height == w->requested_desktop_height)
+		return;
+
+	if (vnc_client_set_desktop_size(w->vnc, w->desktop_width,
+				w->desktop_height) < 0)
+		return;
+
+	w->requested_desktop_width = w->desktop_width;
+	w->requested_desktop_height = w->desktop_height;
+}
+
+/* Let the server downscale by an integer factor when the window is much
+ * smaller than the remote desktop. The framebuffer shrinks accordingly and the
+ * server scales pointer coordinates back up, so the regular transform applies.
+ * Any local decode scaling already accounts for part of the reduction.
+ */
+static void window_request_server_scale(struct window* w)
+{
+	struct vnc_client* vnc = w->vnc;
+	int full_width = vnc->client->width * vnc->server_scale;
+	int full_height = vnc->client->height * vnc->server_scale;
+
+	int scale = fmin(full_width / (w->desktop_width * vnc->decode_scale),
+			full_height / (w->desktop_height * vnc->decode_scale));
+	scale = fmax(1, fmin(scale, SERVER_SCALE_MAX));
+
+	if (scale != vnc->server_scale)
+		vnc_client_set_server_scale(vnc, scale);
+}
+
+static void on_configure_settled(void* obj)
+{
+	is_configure_pending = false;
+
+	if (use_remote_resize)
+		window_request_desktop_size(window);
+
+	if (use_server_scale)
+		window_request_server_scale(window);
+}
+
+/* Interactive resizing produces a storm of configure events, so wait for it to
+ * settle before asking the server to resize or rescale.
+ */
+static void window_schedule_configure(struct window* w, int width,
+		int height)
+{
+	struct aml* aml = aml_get_default();
+
+	w->desktop_width = width;
+	w->desktop_height = height;
+
+	if (is_configure_pending)
+		aml_stop(aml, configure_timer);
+
+	is_configure_pending = aml_start(aml, configure_timer) == 0;
+}
+
+static void window_update_visibility(struct window* w)
+{
+	if (w->vnc)
+		vnc_client_set_updates_paused(w->vnc,
+				w->is_suspended || w->is_frame_overdue);
 }
 
 static void xdg_toplevel_configure(void* data, struct xdg_toplevel* toplevel,
 		int32_t width, int32_t height, struct wl_array* state)
 {
-	int32_t scale = output_list_get_max_scale(&outputs);
-	window_resize(data, width, height, scale);
+	struct window* w = data;
+
+	bool is_suspended = false;
+	uint32_t* s;
+	wl_array_for_each(s, state)
+		if (*s == XDG_TOPLEVEL_STATE_SUSPENDED)
+			is_suspended = true;
+
+	w->is_suspended = is_suspended;
+	window_update_visibility(w);
+
+	double scale = window_get_scale(w);
+	window_resize(w, width, height, scale);
+	window_update_viewport(w);
+
+	if (configure_timer && width != 0 && height != 0)
+		window_schedule_configure(w, round(width * scale),
+				round(height * scale));
 }
 
 static void xdg_toplevel_close(void* data, struct xdg_toplevel* toplevel)
@@ -437,18 +1167,206 @@ static void xdg_toplevel_close(void* data, struct xdg_toplevel* toplevel)
 	do_run = false;
 }
 
+static void xdg_toplevel_configure_bounds(void* data,
+		struct xdg_toplevel* toplevel, int32_t width, int32_t height)
+{
+}
+
+static void xdg_toplevel_wm_capabilities(void* data,
+		struct xdg_toplevel* toplevel, struct wl_array* capabilities)
+{
+}
+
 static const struct xdg_toplevel_listener xdg_toplevel_listener = {
 	.configure = xdg_toplevel_configure,
 	.close = xdg_toplevel_close,
+	.configure_bounds = xdg_toplevel_configure_bounds,
+	.wm_capabilities = xdg_toplevel_wm_capabilities,
+};
+
+static void fractional_scale_preferred_scale(void* data,
+		struct wp_fractional_scale_v1* fractional_scale, uint32_t scale)
+{
+	struct window* w = data;
+	double preferred_scale = scale / 120.0;
+
+	if (preferred_scale == w->preferred_scale)
+		return;
+
+	w->preferred_scale = preferred_scale;
+
+	if (!w->width || !w->height)
+		return;
+
+	window_resize(w, w->width, w->height, preferred_scale);
+	window_update_viewport(w);
+
+	if (configure_timer)
+		window_schedule_configure(w, round(w->width * preferred_scale),
+				round(w->height * preferred_scale));
+
+	if (w->is_configured && w->vnc_fb)
+		render_from_vnc();
+}
+
+static const struct wp_fractional_scale_v1_listener fractional_scale_listener = {
+	.preferred_scale = fractional_scale_preferred_scale,
 };
 
+static void window_destroy_content_surface(struct window* w)
+{
+	if (w->viewport)
+		wp_viewport_destroy(w->viewport);
+	if (w->content_viewport)
+		wp_viewport_destroy(w->content_viewport);
+	if (w->content_subsurface)
+		wl_subsurface_destroy(w->content_subsurface);
+	if (w->content_surface)
+		wl_surface_destroy(w->content_surface);
+	if (w->background_shm)
+		buffer_destroy(w->background_shm);
+	else if (w->background_pixel)
+		wl_buffer_destroy(w->background_pixel);
+
+	w->viewport = NULL;
+	w->content_viewport = NULL;
+	w->content_subsurface = NULL;
+	w->content_surface = NULL;
+	w->background_shm = NULL;
+	w->background_pixel = NULL;
+}
+
+static int window_create_content_surface(struct window* w)
+{
+	if (single_pixel_manager) {
+		w->background_pixel =
+			wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer(
+					single_pixel_manager, 0, 0, 0, UINT32_MAX);
+	} else {
+		// A zero-filled XRGB pixel is black too
+		w->background_shm = buffer_create_shm(1, 1, 4, shm_format);
+		if (w->background_shm)
+			w->background_pixel = w->background_shm->wl_buffer;
+	}
+	if (!w->background_pixel)
+		goto failure;
+
+	w->content_surface = wl_compositor_create_surface(wl_compositor);
+	if (!w->content_surface)
+		goto failure;
+
+	w->content_subsurface = wl_subcompositor_get_subsurface(
+			wl_subcompositor, w->content_surface, w->wl_surface);
+	if (!w->content_subsurface)
+		goto failure;
+
+	wl_subsurface_set_desync(w->content_subsurface);
+
+	w->content_viewport = wp_viewporter_get_viewport(wp_viewporter,
+			w->content_surface);
+	w->viewport = wp_viewporter_get_viewport(wp_viewporter,
+			w->wl_surface);
+	if (!w->content_viewport || !w->viewport)
+		goto failure;
+
+	// Let all input go to the main surface so there's only one origin
+	struct wl_region* empty = wl_compositor_create_region(wl_compositor);
+	wl_surface_set_input_region(w->content_surface, empty);
+	wl_region_destroy(empty);
+
+	return 0;
+
+failure:
+	window_destroy_content_surface(w);
+	return -1;
+}
+
+/* Takes over the modifiers of the feedback. An invalid modifier only means
+ * that implicit ones are allowed, so it is left out.
+ */
+static void dmabuf_take_modifiers(struct dmabuf_feedback* feedback,
+		uint64_t** modifiers, int* n_modifiers)
+{
+	int n = 0;
+	for (int i = 0; i < feedback->n_modifiers; ++i)
+		if (feedback->modifiers[i] != DRM_FORMAT_MOD_INVALID)
+			feedback->modifiers[n++] = feedback->modifiers[i];
+
+	*modifiers = NULL;
+	*n_modifiers = n;
+
+	if (n > 0) {
+		*modifiers = feedback->modifiers;
+		feedback->modifiers = NULL;
+		feedback->n_modifiers = 0;
+	}
+}
+
+/* The compositor's preferences for the surface change with the output that it
+ * is on. Buffers are reallocated to match, so that they can be scanned out
+ * directly where possible.
+ */
+static void window_handle_dmabuf_feedback(struct dmabuf_feedback* feedback,
+		void* userdata)
+{
+	struct window* w = userdata;
+
+	// The framebuffer and renderer stay with the format from startup
+	if (feedback->format != dmabuf_format)
+		return;
+
+	uint64_t* modifiers;
+	int n_modifiers;
+	dmabuf_take_modifiers(feedback, &modifiers, &n_modifiers);
+
+	if (feedback->is_scanout == dmabuf_scanout &&
+			n_modifiers == n_dmabuf_modifiers &&
+			(n_modifiers == 0 || memcmp(modifiers, dmabuf_modifiers,
+				n_modifiers * sizeof(*modifiers)) == 0)) {
+		free(modifiers);
+		return;
+	}
+
+	free(dmabuf_modifiers);
+	dmabuf_modifiers = modifiers;
+	n_dmabuf_modifiers = n_modifiers;
+	dmabuf_scanout = feedback->is_scanout;
+
+	// The first round usually arrives before any buffers are allocated
+	if (!w->buffers[0])
+		return;
+
+	int buffer_width = w->buffer_width;
+	int buffer_height = w->buffer_height;
+	window_realloc_buffers(w, w->buffers[0]->width,
+			w->buffers[0]->height, w->buffers[0]->scale);
+	w->buffer_width = buffer_width;
+	w->buffer_height = buffer_height;
+
+	if (!w->vnc_fb)
+		return;
+
+	pixman_region32_union_rect(&w->current_damage, &w->current_damage,
+			0, 0, vnc_client_get_width(w->vnc),
+			vnc_client_get_height(w->vnc));
+
+	if (w->is_configured)
+		render_from_vnc();
+}
+
 static struct window* window_create(const char* app_id, const char* title)
 {
 	struct window* w = calloc(1, sizeof(*w));
 	if (!w)
 		return NULL;
 
-	pixman_region_init(&w->current_damage);
+	pixman_region32_init(&w->current_damage);
+	pixman_region32_init(&w->upload_damage);
+	pixman_region32_init(&w->copy_damage);
+	for (int i = 0; i < DAMAGE_HISTORY_LENGTH; ++i)
+		pixman_region32_init(&w->damage_history[i]);
+
+	w->n_buffers = DEFAULT_BUFFERS;
 
 	w->wl_surface = wl_compositor_create_surface(wl_compositor);
 	if (!w->wl_surface)
@@ -468,6 +1386,40 @@ static struct window* window_create(const char* app_id, const char* title)
 
 	xdg_toplevel_set_app_id(w->xdg_toplevel, app_id);
 	xdg_toplevel_set_title(w->xdg_toplevel, title);
+
+	/* The zoomed viewport mode crops and pans on its own, so compositor
+	 * scaling is only used for fitting the desktop into the window.
+	 */
+	if (wp_viewporter && wl_subcompositor && viewport_zoom <= 0.0)
+		window_create_content_surface(w);
+	else if (wp_viewporter && fractional_scale_manager)
+		w->viewport = wp_viewporter_get_viewport(wp_viewporter,
+				w->wl_surface);
+
+	if (w->viewport && fractional_scale_manager) {
+		w->fractional_scale =
+			wp_fractional_scale_manager_v1_get_fractional_scale(
+					fractional_scale_manager, w->wl_surface);
+		wp_fractional_scale_v1_add_listener(w->fractional_scale,
+				&fractional_scale_listener, w);
+	}
+
+	if (syncobj_manager)
+		w->syncobj_surface = wp_linux_drm_syncobj_manager_v1_get_surface(
+				syncobj_manager, window_buffer_surface(w));
+
+	if (have_egl && zwp_linux_dmabuf_v1_get_version(
+				zwp_linux_dmabuf_v1) >= 4) {
+		w->dmabuf_feedback = dmabuf_feedback_get_surface(
+				zwp_linux_dmabuf_v1, window_buffer_surface(w),
+				dmabuf_format);
+		if (w->dmabuf_feedback) {
+			w->dmabuf_feedback->on_done =
+				window_handle_dmabuf_feedback;
+			w->dmabuf_feedback->userdata = w;
+		}
+	}
+
 	wl_surface_commit(w->wl_surface);
 
 	return w;
@@ -483,17 +1435,104 @@ wl_surface_failure:
 
 static void window_destroy(struct window* w)
 {
-	for (int i = 0; i < 3; ++i)
+	for (int i = 0; i < w->n_buffers; ++i)
 		buffer_destroy(w->buffers[i]);
 
-	free(w->vnc_fb);
+	if (w->fractional_scale)
+		wp_fractional_scale_v1_destroy(w->fractional_scale);
+	if (w->syncobj_surface)
+		wp_linux_drm_syncobj_surface_v1_destroy(w->syncobj_surface);
+	dmabuf_feedback_destroy(w->dmabuf_feedback);
+	window_destroy_content_surface(w);
+
+	if (w->vnc_fb && !w->is_fb_in_buffer)
+		munmap(w->vnc_fb, w->vnc_fb_size);
 	xdg_toplevel_destroy(w->xdg_toplevel);
 	xdg_surface_destroy(w->xdg_surface);
 	wl_surface_destroy(w->wl_surface);
-	pixman_region_fini(&w->current_damage);
+	for (int i = 0; i < DAMAGE_HISTORY_LENGTH; ++i)
+		pixman_region32_fini(&w->damage_history[i]);
+	pixman_region32_fini(&w->copy_damage);
+	pixman_region32_fini(&w->upload_damage);
+	pixman_region32_fini(&w->current_damage);
 	free(w);
 }
 
+static bool is_pan_modifier_active(void)
+{
+	struct keyboard* keyboard;
+	wl_list_for_each(keyboard, &keyboards->keyboards, link) {
+		if (!keyboard->state)
+			continue;
+
+		if (xkb_state_mod_name_is_active(keyboard->state,
+					XKB_MOD_NAME_CTRL,
+					XKB_STATE_MODS_EFFECTIVE) > 0 &&
+				xkb_state_mod_name_is_active(keyboard->state,
+					XKB_MOD_NAME_SHIFT,
+					XKB_STATE_MODS_EFFECTIVE) > 0)
+			return true;
+	}
+
+	return false;
+}
+
+static void window_pan(struct window* w, double dx, double dy)
+{
+	struct point old_view = w->view;
+
+	w->view.x += dx;
+	w->view.y += dy;
+	window_update_viewport(w);
+
+	if (w->view.x == old_view.x && w->view.y == old_view.y)
+		return;
+
+	struct pixman_box32 box;
+	window_get_visible_rect(w, &box);
+	pixman_region32_union_rect(&w->current_damage, &w->current_damage,
+			box.x1, box.y1, box.x2 - box.x1, box.y2 - box.y1);
+
+	render_from_vnc();
+}
+
+/* Ctrl+Shift combined with dragging or scrolling moves the viewport around
+ * instead of being sent to the server.
+ */
+static bool window_handle_pan(struct window* w, struct pointer* pointer,
+		struct point coord)
+{
+	double scale = viewport_zoom;
+	bool was_pressed = w->pointer_buttons & POINTER_BUTTON_LEFT;
+	bool is_pressed = pointer->pressed & POINTER_BUTTON_LEFT;
+
+	if (w->is_panning) {
+		window_pan(w, (w->pan_origin.x - coord.x) / scale,
+				(w->pan_origin.y - coord.y) / scale);
+		w->pan_origin = coord;
+		w->is_panning = is_pressed;
+		return true;
+	}
+
+	if (!is_pan_modifier_active())
+		return false;
+
+	if (is_pressed && !was_pressed) {
+		w->is_panning = true;
+		w->pan_origin = coord;
+		return true;
+	}
+
+	int vertical_steps = pointer->vertical_scroll_steps;
+	int horizontal_steps = pointer->horizontal_scroll_steps;
+	if (!vertical_steps && !horizontal_steps)
+		return false;
+
+	window_pan(w, horizontal_steps * VIEWPORT_SCROLL_STEP / scale,
+			vertical_steps * VIEWPORT_SCROLL_STEP / scale);
+	return true;
+}
+
 void on_pointer_event(struct pointer_collection* collection,
 		struct pointer* pointer)
 {
@@ -507,8 +1546,22 @@ void on_pointer_event(struct pointer_collection* collection,
 			wl_fixed_to_double(pointer->x),
 			wl_fixed_to_double(pointer->y));
 
-	int x = round((coord.x - (double)x_pos) / scale);
-	int y = round((coord.y - (double)y_pos) / scale);
+	bool is_pan_event = viewport_zoom > 0.0 &&
+		window_handle_pan(window, pointer, coord);
+	window->pointer_buttons = pointer->pressed;
+	if (is_pan_event)
+		return;
+
+	int x, y;
+	if (window->content_surface) {
+		x = floor((wl_fixed_to_double(pointer->x) - window->content_x) /
+				window->content_scale);
+		y = floor((wl_fixed_to_double(pointer->y) - window->content_y) /
+				window->content_scale);
+	} else {
+		x = round((coord.x - (double)x_pos) / scale);
+		y = round((coord.y - (double)y_pos) / scale);
+	}
 
 	enum pointer_button_mask pressed = pointer->pressed;
 	int vertical_steps = pointer->vertical_scroll_steps;
@@ -569,43 +1622,145 @@ int on_vnc_client_alloc_fb(struct vnc_client* client)
 		window = window_create(app_id, vnc_client_get_desktop_name(client));
 		window->vnc = client;
 
-		int32_t scale = output_list_get_max_scale(&outputs);
-		window_resize(window, width, height, scale);
+		double scale = window_get_scale(window);
+		int window_width = width;
+		int window_height = height;
+
+		if (viewport_zoom > 0.0) {
+			window_width = fmin(round(width * viewport_zoom / scale),
+					VIEWPORT_DEFAULT_WIDTH);
+			window_height = fmin(round(height * viewport_zoom / scale),
+					VIEWPORT_DEFAULT_HEIGHT);
+		}
+
+		window_resize(window, window_width, window_height, scale);
 	}
 
-	free(window->vnc_fb);
-	window->vnc_fb = malloc(height * stride);
-	assert(window->vnc_fb);
+	if (window->vnc_fb && !window->is_fb_in_buffer)
+		munmap(window->vnc_fb, window->vnc_fb_size);
+
+	if (window->content_surface)
+		window_realloc_buffers(window, width, height, 1);
+
+	/* Without scaling, the software renderer has nothing to composite, so
+	 * updates are decoded straight into the shm buffers.
+	 */
+	window->is_fb_in_buffer = !have_egl && window->content_surface &&
+		window->back_buffer->stride == stride;
+
+	if (window->is_fb_in_buffer) {
+		window->vnc_fb_size = 0;
+		window->vnc_fb = window->back_buffer->pixels;
+		pixman_region32_clear(&window->back_buffer->damage);
+		window->back_buffer->frame = window->frame;
+	} else {
+		/* Pages are only backed by memory once something has been
+		 * decoded into them, so in viewport mode only the parts around
+		 * the viewport take up space.
+		 */
+		window->vnc_fb_size = height * stride;
+		window->vnc_fb = mmap(NULL, window->vnc_fb_size,
+				PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+				-1, 0);
+		assert(window->vnc_fb != MAP_FAILED);
+	}
 
 	vnc_client_set_fb(client, window->vnc_fb);
+	window_update_viewport(window);
+
+	// The old textures hold the contents of the previous framebuffer
+	if (have_egl)
+		egl_reset_textures();
+
+	if (window->content_surface) {
+		window_layout_content(window);
+		if (window->is_configured)
+			window_commit_layout(window);
+	}
+
 	return 0;
 }
 
-static void get_frame_damage(struct vnc_client* client,
-		struct pixman_region16* damage)
+/* CopyRects can be repeated by the renderer, unless their source has been
+ * drawn to since the last frame. Otherwise, their destinations are uploaded
+ * like any other damage.
+ */
+static void window_add_copy_rects(struct window* w)
+{
+	struct vnc_client* client = w->vnc;
+
+	for (int i = 0; i < client->n_copy_rects; ++i) {
+		const struct vnc_copy_rect* rect = &client->copy_rects[i];
+
+		pixman_region32_union_rect(&w->current_damage,
+				&w->current_damage, rect->dst_x, rect->dst_y,
+				rect->width, rect->height);
+
+		struct pixman_box32 src = {
+			.x1 = rect->src_x,
+			.y1 = rect->src_y,
+			.x2 = rect->src_x + rect->width,
+			.y2 = rect->src_y + rect->height,
+		};
+
+		if (w->n_copy_rects < VNC_CLIENT_MAX_COPY_RECTS &&
+				pixman_region32_contains_rectangle(
+					&w->upload_damage, &src) ==
+				PIXMAN_REGION_OUT) {
+			w->copy_rects[w->n_copy_rects++] = *rect;
+			pixman_region32_union_rect(&w->copy_damage,
+					&w->copy_damage, rect->dst_x,
+					rect->dst_y, rect->width, rect->height);
+		} else {
+			pixman_region32_union_rect(&w->upload_damage,
+					&w->upload_damage, rect->dst_x,
+					rect->dst_y, rect->width, rect->height);
+		}
+	}
+}
+
+static void window_add_frame_damage(struct window* w)
 {
-	pixman_region_union(damage, damage, &client->damage);
+	struct vnc_client* client = w->vnc;
+
+	window_add_copy_rects(w);
+
+	struct pixman_region32 damage;
+	pixman_region32_init(&damage);
+	dirty_tiles_to_region(&client->damage, &damage);
+
+	pixman_region32_union(&w->current_damage, &w->current_damage, &damage);
+	pixman_region32_union(&w->upload_damage, &w->upload_damage, &damage);
+	pixman_region32_fini(&damage);
 
 	for (int i = 0; i < client->n_av_frames; ++i) {
 		const struct vnc_av_frame* frame = client->av_frames[i];
 
-		pixman_region_union_rect(damage, damage, frame->x, frame->y,
+		pixman_region32_union_rect(&w->current_damage,
+				&w->current_damage, frame->x, frame->y,
 				frame->width, frame->height);
 	}
 }
 
-static void apply_buffer_damage(struct pixman_region16* damage)
+/* Records the damage of a new frame and brings the back buffer up to date
+ * according to its age.
+ */
+static void apply_buffer_damage(struct pixman_region32* damage)
 {
-	for (int i = 0; i < 3; ++i)
-		pixman_region_union(&window->buffers[i]->damage,
-				&window->buffers[i]->damage, damage);
+	window->frame++;
+	pixman_region32_copy(
+			&window->damage_history[window->frame %
+			DAMAGE_HISTORY_LENGTH], damage);
+
+	window_age_buffer_damage(window, window->back_buffer);
 }
 
 static void window_damage_region(struct window* w,
-		struct pixman_region16* damage)
+		struct pixman_region32* damage)
 {
 	int n_rects = 0;
-	struct pixman_box16* box = pixman_region_rectangles(damage, &n_rects);
+	struct pixman_box32* box = pixman_region32_rectangles(damage, &n_rects);
 
 	for (int i = 0; i < n_rects; ++i) {
 		int x = box[i].x1;
@@ -617,9 +1772,11 @@ static void window_damage_region(struct window* w,
 	}
 }
 
+static void window_present_frame(void);
+
 static void render_from_vnc(void)
 {
-	if (!pixman_region_not_empty(&window->current_damage) &&
+	if (!pixman_region32_not_empty(&window->current_damage) &&
 			window->vnc->n_av_frames == 0)
 		return;
 
@@ -631,45 +1788,75 @@ static void render_from_vnc(void)
 
 	window_attach(window, 0, 0);
 
+	/* Content buffers match the framebuffer, so damage can be passed on
+	 * as it is.
+	 */
+	if (window->content_surface) {
+		apply_buffer_damage(&window->current_damage);
+		window_damage_region(window, &window->current_damage);
+		window_present_frame();
+		return;
+	}
+
 	double scale;
 	int x_pos, y_pos;
 	window_calculate_transform(window, &scale, &x_pos, &y_pos);
 
-	struct pixman_region16 damage_scaled = { 0 }, buffer_damage = { 0 },
+	struct pixman_region32 damage_scaled = { 0 }, buffer_damage = { 0 },
 			       surface_damage = { 0 };
 	region_scale(&damage_scaled, &window->current_damage, scale);
 	region_translate(&buffer_damage, &damage_scaled, x_pos, y_pos);
-	pixman_region_clear(&damage_scaled);
+	pixman_region32_clear(&damage_scaled);
 
-	double output_scale = output_list_get_max_scale(&outputs);
+	double output_scale = window_get_scale(window);
 	struct point scoord = buffer_coord_to_surface_coord(x_pos, y_pos);
 	region_scale(&damage_scaled, &window->current_damage,
 			scale / output_scale);
 	region_translate(&surface_damage, &damage_scaled, scoord.x, scoord.y);
-	pixman_region_fini(&damage_scaled);
+	pixman_region32_fini(&damage_scaled);
 
 	apply_buffer_damage(&buffer_damage);
-	window_damage_region(window, &surface_damage);
+	window_damage_region(window, window->viewport ? &buffer_damage :
+			&surface_damage);
+
+	pixman_region32_fini(&surface_damage);
+	pixman_region32_fini(&buffer_damage);
 
-	pixman_region_fini(&surface_damage);
-	pixman_region_fini(&buffer_damage);
+	window_present_frame();
+}
 
+static void window_present_frame(void)
+{
 	window_transfer_pixels(window);
 
 	window->is_frame_committed = true;
 	register_frame_callback();
 
+	aml_stop(aml_get_default(), frame_timer);
+	aml_start(aml_get_default(), frame_timer);
+
 	window_commit(window);
 	window_swap(window);
 
-	pixman_region_clear(&window->current_damage);
+	pixman_region32_clear(&window->current_damage);
+	pixman_region32_clear(&window->upload_damage);
+	pixman_region32_clear(&window->copy_damage);
+	window->n_copy_rects = 0;
 	vnc_client_clear_av_frames(window->vnc);
+	vnc_client_clear_yuv_rects(window->vnc);
 }
 
 void on_vnc_client_update_fb(struct vnc_client* client)
 {
-	get_frame_damage(window->vnc, &window->current_damage);
+	window_add_frame_damage(window);
 	render_from_vnc();
+
+	/* The server may not have told us about its screen layout when the
+	 * window was configured, so try again.
+	 */
+	if (use_remote_resize && window->desktop_width &&
+			!is_configure_pending)
+		window_request_desktop_size(window);
 }
 
 static void handle_frame_callback(void* data, struct wl_callback* callback,
@@ -678,6 +1865,12 @@ static void handle_frame_callback(void* data, struct wl_callback* callback,
 	wl_callback_destroy(callback);
 	window->is_frame_committed = false;
 
+	aml_stop(aml_get_default(), frame_timer);
+	if (window->is_frame_overdue) {
+		window->is_frame_overdue = false;
+		window_update_visibility(window);
+	}
+
 	if (!window->vnc->is_updating)
 		render_from_vnc();
 }
@@ -686,9 +1879,19 @@ static const struct wl_callback_listener frame_listener = {
 	.done = handle_frame_callback
 };
 
+/* Compositors stop sending frame callbacks to windows that are minimised or
+ * otherwise hidden, so there's no point in fetching updates until they resume.
+ */
+static void on_frame_timeout(void* obj)
+{
+	window->is_frame_overdue = true;
+	window_update_visibility(window);
+}
+
 static void register_frame_callback(void)
 {
-	struct wl_callback* callback = wl_surface_frame(window->wl_surface);
+	struct wl_callback* callback =
+		wl_surface_frame(window_buffer_surface(window));
 	wl_callback_add_listener(callback, &frame_listener, NULL);
 }
 
@@ -733,18 +1936,24 @@ static int find_render_node(char *node, size_t maxlen) {
 	return r;
 }
 
-static int init_gbm_device(void)
+static int init_gbm_device(const struct dmabuf_feedback* feedback)
 {
 	int rc;
 
-	char render_node[256];
-	rc = find_render_node(render_node, sizeof(render_node));
-	if (rc < 0)
-		return -1;
+	// Prefer the device that the compositor uses for compositing
+	if (feedback)
+		drm_fd = dmabuf_feedback_open_main_device(feedback);
 
-	drm_fd = open(render_node, O_RDWR);
-	if (drm_fd < 0)
-		return 1;
+	if (drm_fd < 0) {
+		char render_node[256];
+		rc = find_render_node(render_node, sizeof(render_node));
+		if (rc < 0)
+			return -1;
+
+		drm_fd = open(render_node, O_RDWR);
+		if (drm_fd < 0)
+			return 1;
+	}
 
 	gbm_device = gbm_create_device(drm_fd);
 	if (!gbm_device) {
@@ -763,20 +1972,40 @@ static int init_egl_renderer(void)
 		return -1;
 	}
 
-	zwp_linux_dmabuf_v1_add_listener(zwp_linux_dmabuf_v1,
-			&dmabuf_listener, NULL);
-	wl_display_roundtrip(wl_display);
+	struct dmabuf_feedback* feedback = NULL;
+
+	if (zwp_linux_dmabuf_v1_get_version(zwp_linux_dmabuf_v1) >= 4) {
+		feedback = dmabuf_feedback_get_default(zwp_linux_dmabuf_v1);
+		if (!feedback)
+			goto failure;
+
+		while (!feedback->is_done)
+			if (wl_display_roundtrip(wl_display) < 0)
+				break;
+
+		dmabuf_format = feedback->format;
+		dmabuf_scanout = feedback->is_scanout;
+		dmabuf_take_modifiers(feedback, &dmabuf_modifiers,
+				&n_dmabuf_modifiers);
+	} else {
+		zwp_linux_dmabuf_v1_add_listener(zwp_linux_dmabuf_v1,
+				&dmabuf_listener, NULL);
+		wl_display_roundtrip(wl_display);
+	}
 
 	if (dmabuf_format == DRM_FORMAT_INVALID) {
 		printf("No supported dmabuf pixel format found. Using software rendering.\n");
 		goto failure;
 	}
 
-	if (init_gbm_device() < 0) {
+	if (init_gbm_device(feedback) < 0) {
 		printf("Failed to find render node. Using software rendering.\n");
 		goto failure;
 	}
 
+	dmabuf_feedback_destroy(feedback);
+	feedback = NULL;
+
 	if (egl_init() < 0) {
 		printf("Failed initialise EGL. Using software rendering.\n");
 		goto failure;
@@ -787,6 +2016,11 @@ static int init_egl_renderer(void)
 	return 0;
 
 failure:
+	dmabuf_feedback_destroy(feedback);
+	free(dmabuf_modifiers);
+	dmabuf_modifiers = NULL;
+	n_dmabuf_modifiers = 0;
+
 	if (zwp_linux_dmabuf_v1) {
 		zwp_linux_dmabuf_v1_destroy(zwp_linux_dmabuf_v1);
 		zwp_linux_dmabuf_v1 = NULL;
@@ -795,6 +2029,26 @@ failure:
 	return -1;
 }
 
+/* The compositor is told when buffers are ready through DRM syncobj timeline
+ * points, rather than having the driver wait for rendering implicitly.
+ */
+static void init_explicit_sync(void)
+{
+	if (!syncobj_manager)
+		return;
+
+	uint64_t has_timeline = 0;
+	if (have_egl && egl_has_native_fence_sync() &&
+			drmGetCap(drm_fd, DRM_CAP_SYNCOBJ_TIMELINE,
+				&has_timeline) == 0 && has_timeline) {
+		printf("Using explicit synchronisation...\n");
+		return;
+	}
+
+	wp_linux_drm_syncobj_manager_v1_destroy(syncobj_manager);
+	syncobj_manager = NULL;
+}
+
 static void on_canary_tick(void* obj)
 {
 	(void)obj;
@@ -843,13 +2097,32 @@ Usage: wlvncc <address> [port]\n\
 \n\
     -a,--app-id=<name>       Set the app-id of the window. Default: wlvncc\n\
     -c,--compression         Compression level (0 - 9).\n\
+    -d,--decode-scale=<n>    Keep the remote desktop at 1/<n> resolution\n\
+                             locally (2, 4 or 8). Saves CPU and memory when\n\
+                             only a thumbnail is needed.\n\
     -e,--encodings=<list>    Set allowed encodings, comma separated list.\n\
-                             Supported values: tight, zrle, ultra, copyrect,\n\
-                             hextile, zlib, corre, rre, raw, open-h264.\n\
+                             Supported values: tight, " TIGHTPNG_HELP "zrle, ultra,\n\
+                             copyrect, hextile, zlib, corre, rre, raw,\n\
+                             open-h264.\n\
     -h,--help                Get help.\n\
+    -l,--lossless-delay=<ms> Refresh JPEG-coded regions losslessly after they\n\
+                             have been idle for <ms>. Default: off\n\
     -n,--hide-cursor         Hide the client-side cursor.\n\
+    -o,--upload-overdraw=<n> Merge damaged rectangles into fewer texture\n\
+                             uploads as long as no more than <n> percent\n\
+                             of the uploaded pixels are undamaged.\n\
+                             Default: 25\n\
     -q,--quality             Quality level (0 - 9).\n\
+    -r,--remote-resize       Resize the remote desktop to fit the window\n\
+                             instead of scaling it.\n\
     -s,--use-sw-renderer     Use software rendering.\n\
+    -S,--server-scale        Let the server scale the desktop down by an\n\
+                             integer factor when the window is much smaller\n\
+                             (UltraVNC compatible servers only).\n\
+    -z,--zoom=<factor>       Show the remote desktop at a fixed zoom level\n\
+                             instead of fitting it to the window. Only the\n\
+                             visible part is requested from the server.\n\
+                             Hold Ctrl+Shift and drag or scroll to pan.\n\
 \n\
 ");
 	return r;
@@ -863,17 +2136,26 @@ int main(int argc, char* argv[])
 	const char* encodings = NULL;
 	int quality = -1;
 	int compression = -1;
-	static const char* shortopts = "a:q:c:e:hns";
+	int lossless_delay = 0;
+	int decode_scale = 1;
+	int upload_overdraw = 25;
+	static const char* shortopts = "a:q:c:d:e:l:o:z:hnrsS";
 	bool use_sw_renderer = false;
 
 	static const struct option longopts[] = {
 		{ "app-id", required_argument, NULL, 'a' },
 		{ "compression", required_argument, NULL, 'c' },
+		{ "decode-scale", required_argument, NULL, 'd' },
 		{ "encodings", required_argument, NULL, 'e' },
 		{ "help", no_argument, NULL, 'h' },
+		{ "lossless-delay", required_argument, NULL, 'l' },
 		{ "quality", required_argument, NULL, 'q' },
+		{ "upload-overdraw", required_argument, NULL, 'o' },
 		{ "hide-cursor", no_argument, NULL, 'n' },
+		{ "remote-resize", no_argument, NULL, 'r' },
 		{ "use-sw-renderer", no_argument, NULL, 's' },
+		{ "server-scale", no_argument, NULL, 'S' },
+		{ "zoom", required_argument, NULL, 'z' },
 		{ NULL, 0, NULL, 0 }
 	};
 
@@ -892,15 +2174,33 @@ int main(int argc, char* argv[])
 		case 'c':
 			compression = atoi(optarg);
 			break;
+		case 'd':
+			decode_scale = atoi(optarg);
+			break;
 		case 'e':
 			encodings = optarg;
 			break;
+		case 'l':
+			lossless_delay = atoi(optarg);
+			break;
+		case 'o':
+			upload_overdraw = atoi(optarg);
+			break;
 		case 'n':
 			cursor_type = POINTER_CURSOR_NONE;
 			break;
+		case 'r':
+			use_remote_resize = true;
+			break;
 		case 's':
 			use_sw_renderer = true;
 			break;
+		case 'S':
+			use_server_scale = true;
+			break;
+		case 'z':
+			viewport_zoom = atof(optarg);
+			break;
 		case 'h':
 			return usage(0);
 		default:
@@ -932,6 +2232,18 @@ int main(int argc, char* argv[])
 	if (init_signal_handler() < 0)
 		goto signal_handler_failure;
 
+	frame_timer = aml_timer_new(FRAME_CALLBACK_TIMEOUT, on_frame_timeout,
+			NULL, NULL);
+	if (!frame_timer)
+		goto signal_handler_failure;
+
+	if (use_remote_resize || use_server_scale) {
+		configure_timer = aml_timer_new(CONFIGURE_SETTLE_DELAY,
+				on_configure_settled, NULL, NULL);
+		if (!configure_timer)
+			goto configure_timer_failure;
+	}
+
 	wl_display = wl_display_connect(NULL);
 	if (!wl_display) {
 		fprintf(stderr, "Failed to connect to local wayland display\n");
@@ -974,6 +2286,14 @@ int main(int argc, char* argv[])
 	if (!use_sw_renderer)
 		have_egl = init_egl_renderer() == 0;
 
+	if (have_egl)
+		egl_set_upload_overdraw(upload_overdraw / 100.0);
+
+	init_explicit_sync();
+
+	// Shared by the software renderer and the JPEG decoder
+	work_pool_init();
+
 	wl_display_roundtrip(wl_display);
 	wl_display_roundtrip(wl_display);
 
@@ -983,6 +2303,8 @@ int main(int argc, char* argv[])
 
 	vnc->alloc_fb = on_vnc_client_alloc_fb;
 	vnc->update_fb = on_vnc_client_update_fb;
+	vnc->record_copy_rects = have_egl;
+	vnc_client_set_decode_yuv(vnc, have_egl);
 	data_control->vnc_write_clipboard = vnc_send_clipboard;
 
 	if (vnc_client_set_pixel_format(vnc, shm_format) < 0) {
@@ -990,16 +2312,22 @@ int main(int argc, char* argv[])
 		goto vnc_setup_failure;
 	}
 
+	if (vnc_client_set_decode_scale(vnc, decode_scale) < 0) {
+		fprintf(stderr, "Unsupported decode scale: %d\n", decode_scale);
+		goto vnc_setup_failure;
+	}
+
 	if (encodings) {
 		if (!have_egl && strstr(encodings, "open-h264")) {
 			fprintf(stderr, "Open H.264 encoding won't work without EGL\n");
 			goto vnc_setup_failure;
 		}
 	} else if (have_egl) {
-		encodings = "open-h264,tight,zrle,ultra,copyrect,hextile,zlib"
-			",corre,rre,raw";
+		encodings = "open-h264,tight," TIGHTPNG_ENCODING "zrle,ultra"
+			",copyrect,hextile,zlib,corre,rre,raw";
 	} else {
-		encodings = "tight,zrle,ultra,copyrect,hextile,zlib,corre,rre,raw";
+		encodings = "tight," TIGHTPNG_ENCODING "zrle,ultra,copyrect"
+			",hextile,zlib,corre,rre,raw";
 	}
 	vnc_client_set_encodings(vnc, encodings);
 
@@ -1009,6 +2337,9 @@ int main(int argc, char* argv[])
 	if (compression >= 0)
 		vnc_client_set_compression_level(vnc, compression);
 
+	if (lossless_delay > 0)
+		vnc_client_set_lossless_refresh_delay(vnc, lossless_delay);
+
 	if (vnc_client_connect(vnc, address, port) < 0) {
 		fprintf(stderr, "Failed to connect to server\n");
 		goto vnc_setup_failure;
@@ -1040,16 +2371,28 @@ vnc_setup_failure:
 vnc_failure:
 	output_list_destroy(&outputs);
 	seat_list_destroy(&seats);
+	if (fractional_scale_manager)
+		wp_fractional_scale_manager_v1_destroy(fractional_scale_manager);
+	if (syncobj_manager)
+		wp_linux_drm_syncobj_manager_v1_destroy(syncobj_manager);
+	if (single_pixel_manager)
+		wp_single_pixel_buffer_manager_v1_destroy(single_pixel_manager);
+	if (wp_viewporter)
+		wp_viewporter_destroy(wp_viewporter);
+	if (wl_subcompositor)
+		wl_subcompositor_destroy(wl_subcompositor);
 	wl_compositor_destroy(wl_compositor);
 	wl_shm_destroy(wl_shm);
 	xdg_wm_base_destroy(xdg_wm_base);
 	egl_finish();
+	work_pool_finish();
 	if (zwp_linux_dmabuf_v1)
 		zwp_linux_dmabuf_v1_destroy(zwp_linux_dmabuf_v1);
 	if (gbm_device)
 		gbm_device_destroy(gbm_device);
 	if (drm_fd >= 0)
 		close(drm_fd);
+	free(dmabuf_modifiers);
 
 	wl_registry_destroy(wl_registry);
 registry_failure:
@@ -1060,6 +2403,13 @@ pointer_failure:
 event_handler_failure:
 	wl_display_disconnect(wl_display);
 display_failure:
+	if (configure_timer) {
+		aml_stop(aml, configure_timer);
+		aml_unref(configure_timer);
+	}
+configure_timer_failure:
+	aml_stop(aml, frame_timer);
+	aml_unref(frame_timer);
 signal_handler_failure:
 	aml_unref(aml);
 	printf("Exiting...\n");
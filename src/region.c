@@ -17,54 +17,54 @@
 #include <math.h>
 #include <pixman.h>
 
-void region_scale(struct pixman_region16* dst, struct pixman_region16* src,
+void region_scale(struct pixman_region32* dst, struct pixman_region32* src,
 		double scale)
 {
 	if (scale == 1.0) {
-		pixman_region_copy(dst, src);
+		pixman_region32_copy(dst, src);
 		return;
 	}
 
-	pixman_region_fini(dst);
-	pixman_region_init(dst);
+	pixman_region32_fini(dst);
+	pixman_region32_init(dst);
 
 	int n_rects = 0;
-	pixman_box16_t* rects = pixman_region_rectangles(src, &n_rects);
+	pixman_box32_t* rects = pixman_region32_rectangles(src, &n_rects);
 
 	for (int i = 0; i < n_rects; ++i) {
-		pixman_box16_t* r = &rects[i];
+		pixman_box32_t* r = &rects[i];
 
 		int x1 = floor((double)r->x1 * scale);
 		int x2 = ceil((double)r->x2 * scale);
 		int y1 = floor((double)r->y1 * scale);
 		int y2 = ceil((double)r->y2 * scale);
 
-		pixman_region_union_rect(dst, dst, x1, y1, x2 - x1, y2 - y1);
+		pixman_region32_union_rect(dst, dst, x1, y1, x2 - x1, y2 - y1);
 	}
 }
 
-void region_translate(struct pixman_region16* dst, struct pixman_region16* src,
+void region_translate(struct pixman_region32* dst, struct pixman_region32* src,
 		int x, int y)
 {
 	if (x == 0 && y == 0) {
-		pixman_region_copy(dst, src);
+		pixman_region32_copy(dst, src);
 		return;
 	}
 	
-	pixman_region_fini(dst);
-	pixman_region_init(dst);
+	pixman_region32_fini(dst);
+	pixman_region32_init(dst);
 
 	int n_rects = 0;
-	pixman_box16_t* rects = pixman_region_rectangles(src, &n_rects);
+	pixman_box32_t* rects = pixman_region32_rectangles(src, &n_rects);
 
 	for (int i = 0; i < n_rects; ++i) {
-		pixman_box16_t* r = &rects[i];
+		pixman_box32_t* r = &rects[i];
 
 		int x1 = r->x1 + x;
 		int x2 = r->x2 + x;
 		int y1 = r->y1 + y;
 		int y2 = r->y2 + y;
 
-		pixman_region_union_rect(dst, dst, x1, y1, x2 - x1, y2 - y1);
+		pixman_region32_union_rect(dst, dst, x1, y1, x2 - x1, y2 - y1);
 	}
 }
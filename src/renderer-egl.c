@@ -17,6 +17,7 @@
 #include "buffer.h"
 #include "renderer.h"
 #include "renderer-egl.h"
+#include "sync-timeline.h"
 #include "vnc.h"
 
 #include <stdlib.h>
@@ -37,6 +38,21 @@
 #include <libavutil/frame.h>
 #include <libavutil/hwcontext_drm.h>
 
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define PBO_RING_SIZE 3
+
+// Beyond this, draw calls cost more than redrawing the damage extents
+#define MAX_SCISSOR_RECTS 32
+
+// How long the compositor is given to attach a fence to a release point
+#define RELEASE_FENCE_TIMEOUT_MS 20
+
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
+
 #define XSTR(s) STR(s)
 #define STR(s) #s
 
@@ -49,9 +65,23 @@ X(PFNEGLDESTROYIMAGEKHRPROC, eglDestroyImageKHR) \
 X(PFNGLEGLIMAGETARGETTEXTURE2DOESPROC, glEGLImageTargetTexture2DOES) \
 X(PFNGLEGLIMAGETARGETRENDERBUFFERSTORAGEOESPROC, glEGLImageTargetRenderbufferStorageOES) \
 
+// Optional, for explicit sync
+#define EGL_SYNC_EXTENSION_LIST \
+X(PFNEGLCREATESYNCKHRPROC, eglCreateSyncKHR) \
+X(PFNEGLDESTROYSYNCKHRPROC, eglDestroySyncKHR) \
+X(PFNEGLWAITSYNCKHRPROC, eglWaitSyncKHR) \
+X(PFNEGLDUPNATIVEFENCEFDANDROIDPROC, eglDupNativeFenceFDANDROID) \
+
+// Core in GLES 3, with the same signatures as the extensions
+#define GLES3_FUNCTION_LIST \
+X(PFNGLMAPBUFFERRANGEEXTPROC, glMapBufferRange) \
+X(PFNGLUNMAPBUFFEROESPROC, glUnmapBuffer) \
+
 #define X(t, n) static t n;
 	EGL_EXTENSION_LIST
+	EGL_SYNC_EXTENSION_LIST
 	GL_EXTENSION_LIST
+	GLES3_FUNCTION_LIST
 #undef X
 
 enum {
@@ -70,7 +100,56 @@ static EGLContext egl_context = EGL_NO_CONTEXT;
 
 static GLuint shader_program = 0;
 static GLuint shader_program_ext = 0;
-static GLuint texture = 0;
+static GLuint shader_program_yuv = 0;
+static GLint u_tex_u = -1, u_tex_v = -1, u_chroma_scale = -1;
+
+// Y, U and V planes of JPEG rects
+static GLuint yuv_textures[3];
+
+/* The framebuffer is split into a grid of textures, because it may be larger
+ * than the maximum texture size.
+ */
+struct texture_tile {
+	GLuint texture;
+	int x, y, width, height;
+	bool is_initialised;
+};
+
+static struct {
+	struct texture_tile* tiles;
+	int n_tiles;
+	int width, height;
+	uint32_t format;
+} texture_grid;
+
+static GLint max_texture_size = 0;
+
+static bool have_native_fence_sync = false;
+
+struct texture_upload {
+	struct texture_tile* tile;
+	struct pixman_box32 box;
+	uintptr_t offset;
+};
+
+static struct texture_upload* uploads = NULL;
+static int n_uploads = 0;
+static int uploads_capacity = 0;
+
+/* Damaged rectangles are merged for as long as this fraction of the uploaded
+ * pixels or less is undamaged.
+ */
+static double upload_overdraw = 0.25;
+
+// Copies within the framebuffer go through a scratch texture
+static GLuint copy_fbo = 0;
+static GLuint scratch_texture = 0;
+static int scratch_width = 0, scratch_height = 0;
+static uint32_t scratch_format = 0;
+
+static bool have_pbo = false;
+static GLuint pbo_ring[PBO_RING_SIZE];
+static int pbo_index = 0;
 
 static const char *vertex_shader_src =
 "attribute vec2 pos;\n"
@@ -99,6 +178,24 @@ static const char *fragment_shader_ext_src =
 "	gl_FragColor = texture2D(u_tex, v_texture);\n"
 "}\n";
 
+// Full range BT.601, as used by JFIF
+static const char *fragment_shader_yuv_src =
+"precision mediump float;\n"
+"uniform sampler2D u_tex;\n"
+"uniform sampler2D u_tex_u;\n"
+"uniform sampler2D u_tex_v;\n"
+"uniform vec2 u_chroma_scale;\n"
+"varying vec2 v_texture;\n"
+"void main() {\n"
+"	vec2 chroma = v_texture * u_chroma_scale;\n"
+"	float y = texture2D(u_tex, v_texture).r;\n"
+"	float u = texture2D(u_tex_u, chroma).r - 0.5;\n"
+"	float v = texture2D(u_tex_v, chroma).r - 0.5;\n"
+"	gl_FragColor = vec4(y + 1.402 * v,\n"
+"			y - 0.344136 * u - 0.714136 * v,\n"
+"			y + 1.772 * u, 1.0);\n"
+"}\n";
+
 struct {
 	GLuint u_tex;
 } uniforms;
@@ -129,6 +226,43 @@ static int egl_load_gl_ext(void)
 	return 0;
 }
 
+static int egl_load_sync_ext(void)
+{
+	const char* exts = eglQueryString(egl_display, EGL_EXTENSIONS);
+	if (!exts || !strstr(exts, "EGL_ANDROID_native_fence_sync") ||
+			!strstr(exts, "EGL_KHR_wait_sync"))
+		return -1;
+
+#define X(t, n) \
+	n = (t)eglGetProcAddress(XSTR(n)); \
+	if (!n) \
+		return -1;
+
+	EGL_SYNC_EXTENSION_LIST
+#undef X
+
+	return 0;
+}
+
+static int egl_load_gles3(void)
+{
+	const char* version = (const char*)glGetString(GL_VERSION);
+	int major = 0;
+	if (!version || sscanf(version, "OpenGL ES %d", &major) != 1 ||
+			major < 3)
+		return -1;
+
+#define X(t, n) \
+	n = (t)eglGetProcAddress(XSTR(n)); \
+	if (!n) \
+		return -1;
+
+	GLES3_FUNCTION_LIST
+#undef X
+
+	return 0;
+}
+
 static int compile_shaders(const char* vert_src, const char* frag_src)
 {
 	GLuint vert = glCreateShader(GL_VERTEX_SHADER);
@@ -186,13 +320,21 @@ int egl_init(void)
 	if (!rc)
 		goto failure;
 
+	static const EGLint attribs_es3[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 3,
+		EGL_NONE
+	};
+
 	static const EGLint attribs[] = {
 		EGL_CONTEXT_CLIENT_VERSION, 2,
 		EGL_NONE
 	};
 
 	egl_context = eglCreateContext(egl_display, EGL_NO_CONFIG_KHR,
-			EGL_NO_CONTEXT, attribs);
+			EGL_NO_CONTEXT, attribs_es3);
+	if (egl_context == EGL_NO_CONTEXT)
+		egl_context = eglCreateContext(egl_display, EGL_NO_CONFIG_KHR,
+				EGL_NO_CONTEXT, attribs);
 	if (egl_context == EGL_NO_CONTEXT)
 		goto failure;
 
@@ -207,6 +349,20 @@ int egl_init(void)
 			fragment_shader_src);
 	shader_program_ext = compile_shaders(vertex_shader_src,
 			fragment_shader_ext_src);
+	shader_program_yuv = compile_shaders(vertex_shader_src,
+			fragment_shader_yuv_src);
+	u_tex_u = glGetUniformLocation(shader_program_yuv, "u_tex_u");
+	u_tex_v = glGetUniformLocation(shader_program_yuv, "u_tex_v");
+	u_chroma_scale = glGetUniformLocation(shader_program_yuv,
+			"u_chroma_scale");
+
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+
+	have_native_fence_sync = egl_load_sync_ext() == 0;
+
+	have_pbo = egl_load_gles3() == 0;
+	if (have_pbo)
+		glGenBuffers(PBO_RING_SIZE, pbo_ring);
 
 	return 0;
 
@@ -215,10 +371,39 @@ failure:
 	return -1;
 }
 
+bool egl_has_native_fence_sync(void)
+{
+	return have_native_fence_sync;
+}
+
+void egl_reset_textures(void)
+{
+	for (int i = 0; i < texture_grid.n_tiles; ++i)
+		glDeleteTextures(1, &texture_grid.tiles[i].texture);
+
+	free(texture_grid.tiles);
+	memset(&texture_grid, 0, sizeof(texture_grid));
+}
+
+void egl_set_upload_overdraw(double ratio)
+{
+	upload_overdraw = ratio;
+}
+
 void egl_finish(void)
 {
-	if (texture)
-		glDeleteTextures(1, &texture);
+	egl_reset_textures();
+	free(uploads);
+	if (scratch_texture)
+		glDeleteTextures(1, &scratch_texture);
+	if (copy_fbo)
+		glDeleteFramebuffers(1, &copy_fbo);
+	if (yuv_textures[0])
+		glDeleteTextures(3, yuv_textures);
+	if (have_pbo)
+		glDeleteBuffers(PBO_RING_SIZE, pbo_ring);
+	if (shader_program_yuv)
+		glDeleteProgram(shader_program_yuv);
 	if (shader_program_ext)
 		glDeleteProgram(shader_program_ext);
 	if (shader_program)
@@ -229,6 +414,77 @@ void egl_finish(void)
 	eglTerminate(egl_display);
 }
 
+/* Makes the GPU wait until the compositor is done with the buffer, rather than
+ * stalling here. Buffers are picked so that the compositor has normally
+ * attached a fence to the release point already; if it hasn't, it is given a
+ * short while to do so.
+ */
+static void egl_wait_release(struct buffer* dst)
+{
+	if (!dst->timeline || dst->release_point == 0 ||
+			sync_timeline_is_signalled(dst->timeline,
+				dst->release_point))
+		return;
+
+	int fd = sync_timeline_export_sync_file(dst->timeline,
+			dst->release_point, RELEASE_FENCE_TIMEOUT_MS);
+	if (fd < 0) {
+		if (!sync_timeline_is_signalled(dst->timeline,
+					dst->release_point))
+			fprintf(stderr, "Buffer was not released in time\n");
+		return;
+	}
+
+	const EGLint attribs[] = {
+		EGL_SYNC_NATIVE_FENCE_FD_ANDROID, fd,
+		EGL_NONE
+	};
+
+	EGLSyncKHR sync = eglCreateSyncKHR(egl_display,
+			EGL_SYNC_NATIVE_FENCE_ANDROID, attribs);
+	if (sync == EGL_NO_SYNC_KHR) {
+		close(fd);
+		return;
+	}
+
+	eglWaitSyncKHR(egl_display, sync, 0);
+	eglDestroySyncKHR(egl_display, sync);
+}
+
+/* Submits the rendering. With explicit sync, a fence for it is attached to
+ * the next acquire point and the compositor waits for it instead of the
+ * driver doing so implicitly.
+ */
+static void egl_submit(struct buffer* dst)
+{
+	if (!dst->timeline) {
+		glFlush();
+		return;
+	}
+
+	EGLSyncKHR sync = eglCreateSyncKHR(egl_display,
+			EGL_SYNC_NATIVE_FENCE_ANDROID, NULL);
+	glFlush();
+
+	int fd = -1;
+	if (sync != EGL_NO_SYNC_KHR) {
+		fd = eglDupNativeFenceFDANDROID(egl_display, sync);
+		eglDestroySyncKHR(egl_display, sync);
+	}
+
+	dst->acquire_point = sync_timeline_next_point(dst->timeline);
+	dst->release_point = sync_timeline_next_point(dst->timeline);
+
+	if (fd < 0 || sync_timeline_import_sync_file(dst->timeline,
+				dst->acquire_point, fd) < 0) {
+		glFinish();
+		sync_timeline_signal(dst->timeline, dst->acquire_point);
+	}
+
+	if (fd >= 0)
+		close(fd);
+}
+
 static inline void append_attr(EGLint* dst, int* i, EGLint name, EGLint value)
 {
 	dst[*i] = name;
@@ -404,6 +660,36 @@ void gl_draw(void)
 	glDisableVertexAttribArray(ATTR_INDEX_POS);
 }
 
+/* Draws the current quad into the given area of the viewport, once for each
+ * damaged rectangle that intersects it, so that fill rate follows the damaged
+ * area instead of its extents.
+ */
+static void gl_draw_damage(struct pixman_region32* damage, int x1, int y1,
+		int x2, int y2)
+{
+	int n_rects = 0;
+	struct pixman_box32* rects = pixman_region32_rectangles(damage,
+			&n_rects);
+
+	if (n_rects > MAX_SCISSOR_RECTS) {
+		rects = pixman_region32_extents(damage);
+		n_rects = 1;
+	}
+
+	for (int i = 0; i < n_rects; ++i) {
+		int rx1 = MAX(rects[i].x1, x1);
+		int ry1 = MAX(rects[i].y1, y1);
+		int rx2 = MIN(rects[i].x2, x2);
+		int ry2 = MIN(rects[i].y2, y2);
+
+		if (rx1 >= rx2 || ry1 >= ry2)
+			continue;
+
+		glScissor(rx1, ry1, rx2 - rx1, ry2 - ry1);
+		gl_draw();
+	}
+}
+
 GLenum gl_format_from_drm(uint32_t format)
 {
 	switch (format) {
@@ -418,89 +704,615 @@ GLenum gl_format_from_drm(uint32_t format)
 	return 0;
 }
 
-void import_image_with_damage(const struct image* src,
-		struct pixman_region16* damage)
+static int texture_grid_create(const struct image* src)
 {
-	GLenum fmt = gl_format_from_drm(src->format);
+	int tile_size = max_texture_size > 0 ? max_texture_size : 2048;
+	int cols = (src->width + tile_size - 1) / tile_size;
+	int rows = (src->height + tile_size - 1) / tile_size;
+
+	texture_grid.tiles = calloc(cols * rows, sizeof(*texture_grid.tiles));
+	if (!texture_grid.tiles)
+		return -1;
+
+	texture_grid.n_tiles = cols * rows;
+	texture_grid.width = src->width;
+	texture_grid.height = src->height;
+	texture_grid.format = src->format;
+
+	for (int row = 0; row < rows; ++row)
+		for (int col = 0; col < cols; ++col) {
+			struct texture_tile* tile =
+				&texture_grid.tiles[row * cols + col];
+
+			tile->x = col * tile_size;
+			tile->y = row * tile_size;
+			tile->width = MIN(tile_size, src->width - tile->x);
+			tile->height = MIN(tile_size, src->height - tile->y);
+
+			glGenTextures(1, &tile->texture);
+			glBindTexture(GL_TEXTURE_2D, tile->texture);
+
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S,
+					GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T,
+					GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+					GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,
+					GL_LINEAR);
+		}
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return 0;
+}
+
+static int64_t box_area(const struct pixman_box32* box)
+{
+	return (int64_t)(box->x2 - box->x1) * (box->y2 - box->y1);
+}
+
+static void upload_box(struct texture_tile* tile,
+		const struct pixman_box32* box, const void* pixels, GLenum fmt)
+{
+	int width = box->x2 - box->x1;
+	int height = box->y2 - box->y1;
+
+	glBindTexture(GL_TEXTURE_2D, tile->texture);
+
+	if (!tile->is_initialised) {
+		glTexImage2D(GL_TEXTURE_2D, 0, fmt, width, height, 0, fmt,
+				GL_UNSIGNED_BYTE, pixels);
+		tile->is_initialised = true;
+	} else {
+		glTexSubImage2D(GL_TEXTURE_2D, 0, box->x1 - tile->x,
+				box->y1 - tile->y, width, height, fmt,
+				GL_UNSIGNED_BYTE, pixels);
+	}
+}
+
+// For boxes that can't be queued, so that their damage isn't lost
+static void upload_direct(const struct image* src, struct texture_tile* tile,
+		const struct pixman_box32* box)
+{
+	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, src->stride / 4);
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, box->x1);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, box->y1);
+
+	upload_box(tile, box, src->pixels, gl_format_from_drm(src->format));
+
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+}
+
+static void upload_push(const struct image* src, struct texture_tile* tile,
+		const struct pixman_box32* box)
+{
+	if (n_uploads == uploads_capacity) {
+		int capacity = uploads_capacity ? uploads_capacity * 2 : 64;
+		struct texture_upload* new_uploads =
+			realloc(uploads, capacity * sizeof(*uploads));
+		if (!new_uploads) {
+			upload_direct(src, tile, box);
+			return;
+		}
+
+		uploads = new_uploads;
+		uploads_capacity = capacity;
+	}
+
+	uploads[n_uploads++] = (struct texture_upload) {
+		.tile = tile,
+		.box = *box,
+	};
+}
+
+/* pixman sorts rectangles into bands from top to bottom, so neighbours in the
+ * list also tend to be close to each other on screen. Each one is merged into
+ * the bounding box of the previous ones until too much of it is undamaged, or
+ * the box would cover pixels that are stale in the image.
+ */
+static void upload_push_damage(const struct image* src,
+		struct texture_tile* tile, struct pixman_region32* damage,
+		struct pixman_region32* stale)
+{
+	struct pixman_region32 tile_damage;
+	pixman_region32_init(&tile_damage);
+	pixman_region32_intersect_rect(&tile_damage, damage, tile->x, tile->y,
+			tile->width, tile->height);
 
 	int n_rects = 0;
-	struct pixman_box16* rects =
-		pixman_region_rectangles(damage, &n_rects);
+	struct pixman_box32* rects =
+		pixman_region32_rectangles(&tile_damage, &n_rects);
+	if (n_rects == 0)
+		goto done;
+
+	struct pixman_box32 merged = rects[0];
+	int64_t damaged_area = box_area(&rects[0]);
+
+	for (int i = 1; i < n_rects; ++i) {
+		struct pixman_box32 bbox = {
+			.x1 = MIN(merged.x1, rects[i].x1),
+			.y1 = MIN(merged.y1, rects[i].y1),
+			.x2 = MAX(merged.x2, rects[i].x2),
+			.y2 = MAX(merged.y2, rects[i].y2),
+		};
+		int64_t area = damaged_area + box_area(&rects[i]);
+
+		if (box_area(&bbox) <= area * (1.0 + upload_overdraw) &&
+				(!stale || pixman_region32_contains_rectangle(
+					stale, &bbox) == PIXMAN_REGION_OUT)) {
+			merged = bbox;
+			damaged_area = area;
+			continue;
+		}
+
+		upload_push(src, tile, &merged);
+		merged = rects[i];
+		damaged_area = box_area(&rects[i]);
+	}
 
-	for (int i = 0; i < n_rects; ++i) {
-		int x = rects[i].x1;
-		int y = rects[i].y1;
-		int width = rects[i].x2 - x;
-		int height = rects[i].y2 - y;
+	upload_push(src, tile, &merged);
+
+done:
+	pixman_region32_fini(&tile_damage);
+}
+
+/* Damaged pixels are packed into a pixel buffer object, which lets the driver
+ * copy them into the textures asynchronously. Buffers are used in turn and
+ * orphaned before they are mapped, so mapping doesn't wait for the GPU.
+ */
+static bool upload_stage(const struct image* src)
+{
+	size_t size = 0;
+	for (int i = 0; i < n_uploads; ++i) {
+		uploads[i].offset = size;
+		size += box_area(&uploads[i].box) * 4;
+	}
 
-		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, x);
-		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, y);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo_ring[pbo_index]);
+	pbo_index = (pbo_index + 1) % PBO_RING_SIZE;
 
-		glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, fmt,
-				GL_UNSIGNED_BYTE, src->pixels);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+	uint8_t* dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+			GL_MAP_WRITE_BIT_EXT | GL_MAP_INVALIDATE_BUFFER_BIT_EXT);
+	if (!dst) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return false;
+	}
+
+	for (int i = 0; i < n_uploads; ++i) {
+		const struct pixman_box32* box = &uploads[i].box;
+		size_t len = (box->x2 - box->x1) * 4;
+		uint8_t* row = dst + uploads[i].offset;
+
+		for (int y = box->y1; y < box->y2; ++y) {
+			memcpy(row, (const uint8_t*)src->pixels +
+					y * src->stride + box->x1 * 4, len);
+			row += len;
+		}
+	}
+
+	// The contents may have been lost, e.g. on a mode switch
+	if (!glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER)) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return false;
+	}
+
+	return true;
+}
+
+static void upload_flush(const struct image* src)
+{
+	GLenum fmt = gl_format_from_drm(src->format);
+	bool is_staged = have_pbo && n_uploads > 0 && upload_stage(src);
+
+	if (!is_staged)
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, src->stride / 4);
+
+	for (int i = 0; i < n_uploads; ++i) {
+		const struct pixman_box32* box = &uploads[i].box;
+		const void* pixels = src->pixels;
+
+		if (is_staged) {
+			glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT,
+					box->x2 - box->x1);
+			pixels = (const void*)uploads[i].offset;
+		} else {
+			glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, box->x1);
+			glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, box->y1);
+		}
+
+		upload_box(uploads[i].tile, box, pixels, fmt);
 	}
 
 	glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
 	glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+
+	if (is_staged)
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	n_uploads = 0;
 }
 
-void render_image_egl(struct buffer* dst, const struct image* src,
-		double scale, int x_pos, int y_pos)
+static bool scratch_texture_reserve(const struct image* src, int width,
+		int height)
 {
-	struct fbo_info fbo;
-	fbo_from_gbm_bo(&fbo, dst->bo);
+	if (scratch_texture && scratch_format == src->format &&
+			scratch_width >= width && scratch_height >= height)
+		return true;
 
-	glBindFramebuffer(GL_FRAMEBUFFER, fbo.fbo);
+	width = MAX(width, scratch_width);
+	height = MAX(height, scratch_height);
 
-	bool is_new_texture = !texture;
+	if (width > max_texture_size || height > max_texture_size)
+		return false;
 
-	if (!texture)
-		glGenTextures(1, &texture);
+	if (!scratch_texture)
+		glGenTextures(1, &scratch_texture);
 
-	glBindTexture(GL_TEXTURE_2D, texture);
+	GLenum fmt = gl_format_from_drm(src->format);
+	glBindTexture(GL_TEXTURE_2D, scratch_texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, fmt, width, height, 0, fmt,
+			GL_UNSIGNED_BYTE, NULL);
+
+	scratch_width = width;
+	scratch_height = height;
+	scratch_format = src->format;
+	return true;
+}
 
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+static bool copy_fbo_attach(GLuint texture)
+{
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			GL_TEXTURE_2D, texture, 0);
+	return glCheckFramebufferStatus(GL_FRAMEBUFFER) ==
+		GL_FRAMEBUFFER_COMPLETE;
+}
 
-	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, src->stride / 4);
+static bool intersect_tile(int* x1, int* y1, int* x2, int* y2,
+		const struct texture_tile* tile, int x, int y, int width,
+		int height)
+{
+	*x1 = MAX(x, tile->x);
+	*y1 = MAX(y, tile->y);
+	*x2 = MIN(x + width, tile->x + tile->width);
+	*y2 = MIN(y + height, tile->y + tile->height);
+	return *x1 < *x2 && *y1 < *y2;
+}
 
-	if (is_new_texture) {
-		GLenum fmt = gl_format_from_drm(src->format);
-		glTexImage2D(GL_TEXTURE_2D, 0, fmt, src->width, src->height, 0,
-				fmt, GL_UNSIGNED_BYTE, src->pixels);
-	} else {
-		import_image_with_damage(src,
-				(struct pixman_region16*)src->damage);
+/* Source and destination overlap when scrolling, so the source is copied
+ * into the scratch texture first and from there to the destination.
+ */
+static bool texture_grid_copy(const struct image* src,
+		const struct vnc_copy_rect* rect)
+{
+	int x1, y1, x2, y2;
+
+	if (!scratch_texture_reserve(src, rect->width, rect->height))
+		return false;
+
+	for (int i = 0; i < texture_grid.n_tiles; ++i) {
+		struct texture_tile* tile = &texture_grid.tiles[i];
+
+		if (!intersect_tile(&x1, &y1, &x2, &y2, tile, rect->src_x,
+					rect->src_y, rect->width, rect->height))
+			continue;
+
+		if (!copy_fbo_attach(tile->texture))
+			return false;
+
+		glBindTexture(GL_TEXTURE_2D, scratch_texture);
+		glCopyTexSubImage2D(GL_TEXTURE_2D, 0, x1 - rect->src_x,
+				y1 - rect->src_y, x1 - tile->x, y1 - tile->y,
+				x2 - x1, y2 - y1);
 	}
 
+	if (!copy_fbo_attach(scratch_texture))
+		return false;
+
+	for (int i = 0; i < texture_grid.n_tiles; ++i) {
+		struct texture_tile* tile = &texture_grid.tiles[i];
+
+		if (!intersect_tile(&x1, &y1, &x2, &y2, tile, rect->dst_x,
+					rect->dst_y, rect->width, rect->height))
+			continue;
+
+		glBindTexture(GL_TEXTURE_2D, tile->texture);
+		glCopyTexSubImage2D(GL_TEXTURE_2D, 0, x1 - tile->x,
+				y1 - tile->y, x1 - rect->dst_x,
+				y1 - rect->dst_y, x2 - x1, y2 - y1);
+	}
+
+	return true;
+}
+
+/* Repeats the CopyRects of the image on the textures, so that their
+ * destinations don't have to be uploaded. If that isn't possible, false is
+ * returned and the destinations must be uploaded after all.
+ */
+static bool texture_grid_apply_copies(const struct image* src)
+{
+	if (src->n_copy_rects == 0)
+		return true;
+
+	// Fresh textures get all of their contents uploaded anyway
+	for (int i = 0; i < texture_grid.n_tiles; ++i)
+		if (!texture_grid.tiles[i].is_initialised)
+			return false;
+
+	if (!copy_fbo)
+		glGenFramebuffers(1, &copy_fbo);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, copy_fbo);
+
+	bool ok = true;
+	for (int i = 0; i < src->n_copy_rects && ok; ++i)
+		ok = texture_grid_copy(src, &src->copy_rects[i]);
+
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			GL_TEXTURE_2D, 0, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	return ok;
+}
+
+static void yuv_textures_upload(const struct vnc_jpeg_rect* rect)
+{
+	if (!yuv_textures[0]) {
+		glGenTextures(3, yuv_textures);
+
+		for (int i = 0; i < 3; ++i) {
+			glBindTexture(GL_TEXTURE_2D, yuv_textures[i]);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S,
+					GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T,
+					GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+					GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,
+					GL_LINEAR);
+		}
+	}
+
+	/* The planes are padded to whole chroma samples. Only the samples that
+	 * cover the rect are uploaded, and the chroma coordinates are scaled so
+	 * that each sample still covers exactly hsub x vsub luma samples.
+	 */
+	int hsub = rect->plane_width[0] / rect->plane_width[1];
+	int vsub = rect->plane_height[0] / rect->plane_height[1];
+	int chroma_width = (rect->width + hsub - 1) / hsub;
+	int chroma_height = (rect->height + vsub - 1) / vsub;
+
+	glUniform2f(u_chroma_scale,
+			(float)rect->width / (chroma_width * hsub),
+			(float)rect->height / (chroma_height * vsub));
+
+	for (int i = 0; i < 3; ++i) {
+		int width = i == 0 ? rect->width : chroma_width;
+		int height = i == 0 ? rect->height : chroma_height;
+
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(GL_TEXTURE_2D, yuv_textures[i]);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, rect->strides[i]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, width, height, 0,
+				GL_LUMINANCE, GL_UNSIGNED_BYTE, rect->planes[i]);
+	}
+}
+
+static bool texture_tile_is_damaged(const struct texture_tile* tile,
+		struct pixman_region32* damage)
+{
+	struct pixman_box32 box = {
+		.x1 = tile->x,
+		.y1 = tile->y,
+		.x2 = tile->x + tile->width,
+		.y2 = tile->y + tile->height,
+	};
+
+	return pixman_region32_contains_rectangle(damage, &box) !=
+		PIXMAN_REGION_OUT;
+}
+
+/* Has the rect decoded on the CPU instead, adding what was stale to the damage
+ * that still needs to be uploaded.
+ */
+static void texture_grid_resolve_yuv(const struct image* src,
+		struct vnc_jpeg_rect* rect, struct pixman_region32* damage)
+{
+	pixman_region32_union(damage, damage, &rect->stale);
+	src->resolve_yuv_rect(rect, src->userdata);
+}
+
+/* Converts JPEG rects from YUV straight into the textures, wherever nothing
+ * has been drawn over them since.
+ */
+static void texture_grid_draw_yuv(const struct image* src)
+{
+	int x1, y1, x2, y2;
+
+	if (src->n_yuv_rects == 0)
+		return;
+
+	struct pixman_region32 fallback;
+	pixman_region32_init(&fallback);
+
+	if (!shader_program_yuv) {
+		for (int i = 0; i < src->n_yuv_rects; ++i)
+			texture_grid_resolve_yuv(src, src->yuv_rects[i],
+					&fallback);
+		goto upload;
+	}
+
+	if (!copy_fbo)
+		glGenFramebuffers(1, &copy_fbo);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, copy_fbo);
+
+	glUseProgram(shader_program_yuv);
+	glUniform1i(uniforms.u_tex, 0);
+	glUniform1i(u_tex_u, 1);
+	glUniform1i(u_tex_v, 2);
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glEnable(GL_SCISSOR_TEST);
+
+	struct pixman_region32 region;
+	pixman_region32_init(&region);
+
+	for (int i = 0; i < src->n_yuv_rects; ++i) {
+		struct vnc_jpeg_rect* rect = src->yuv_rects[i];
+
+		if (!pixman_region32_not_empty(&rect->stale))
+			continue;
+
+		yuv_textures_upload(rect);
+
+		for (int j = 0; j < texture_grid.n_tiles; ++j) {
+			struct texture_tile* tile = &texture_grid.tiles[j];
+
+			if (!intersect_tile(&x1, &y1, &x2, &y2, tile, rect->x,
+						rect->y, rect->width,
+						rect->height))
+				continue;
+
+			/* Tiles that were drawn to already are simply
+			 * uploaded over.
+			 */
+			if (!copy_fbo_attach(tile->texture)) {
+				texture_grid_resolve_yuv(src, rect, &fallback);
+				break;
+			}
+
+			pixman_region32_copy(&region, &rect->stale);
+			pixman_region32_translate(&region, -tile->x, -tile->y);
+
+			glViewport(rect->x - tile->x, rect->y - tile->y,
+					rect->width, rect->height);
+			gl_draw_damage(&region, x1 - tile->x, y1 - tile->y,
+					x2 - tile->x, y2 - tile->y);
+		}
+	}
+
+	pixman_region32_fini(&region);
+
+	glDisable(GL_SCISSOR_TEST);
 	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	for (int i = 2; i >= 0; --i) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			GL_TEXTURE_2D, 0, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+upload:
+	if (pixman_region32_not_empty(&fallback)) {
+		for (int i = 0; i < texture_grid.n_tiles; ++i) {
+			struct texture_tile* tile = &texture_grid.tiles[i];
+
+			if (texture_tile_is_damaged(tile, &fallback))
+				upload_push_damage(src, tile, &fallback,
+						src->stale);
+		}
+
+		upload_flush(src);
+	}
+
+	pixman_region32_fini(&fallback);
+}
+
+void render_image_egl(struct buffer* dst, const struct image* src,
+		double scale, int x_pos, int y_pos)
+{
+	struct fbo_info fbo;
+	fbo_from_gbm_bo(&fbo, dst->bo);
+
+	struct pixman_region32 damage;
+	pixman_region32_init(&damage);
+	pixman_region32_copy(&damage, src->damage);
+
+	if (texture_grid.width != src->width ||
+			texture_grid.height != src->height ||
+			texture_grid.format != src->format)
+		egl_reset_textures();
+
+	if (!texture_grid.tiles && texture_grid_create(src) < 0)
+		goto done;
+
+	if (!texture_grid_apply_copies(src) && src->copy_damage)
+		pixman_region32_union(&damage, &damage, src->copy_damage);
+
+	for (int i = 0; i < texture_grid.n_tiles; ++i) {
+		struct texture_tile* tile = &texture_grid.tiles[i];
+
+		if (!tile->is_initialised) {
+			struct pixman_box32 box = {
+				.x1 = tile->x,
+				.y1 = tile->y,
+				.x2 = tile->x + tile->width,
+				.y2 = tile->y + tile->height,
+			};
+			upload_push(src, tile, &box);
+		} else if (texture_tile_is_damaged(tile, &damage)) {
+			upload_push_damage(src, tile, &damage,
+					src->stale);
+		}
+	}
+
+	upload_flush(src);
+	texture_grid_draw_yuv(src);
 
-	int width = round((double)src->width * scale);
-	int height = round((double)src->height * scale);
-	glViewport(x_pos, y_pos, width, height);
+	egl_wait_release(dst);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo.fbo);
 
 	glUseProgram(shader_program);
 
-	struct pixman_box16* ext = pixman_region_extents(&dst->damage);
-	glScissor(ext->x1, ext->y1, ext->x2 - ext->x1, ext->y2 - ext->y1);
+	struct pixman_box32* ext = pixman_region32_extents(&dst->damage);
 	glEnable(GL_SCISSOR_TEST);
 
-	gl_draw();
+	/* Edges are rounded the same way for neighbouring tiles, so that there
+	 * are no gaps between them.
+	 */
+	for (int i = 0; i < texture_grid.n_tiles; ++i) {
+		struct texture_tile* tile = &texture_grid.tiles[i];
 
-	glDisable(GL_SCISSOR_TEST);
+		int x1 = round(x_pos + tile->x * scale);
+		int y1 = round(y_pos + tile->y * scale);
+		int x2 = round(x_pos + (tile->x + tile->width) * scale);
+		int y2 = round(y_pos + (tile->y + tile->height) * scale);
 
-	glFlush();
+		if (x2 <= ext->x1 || x1 >= ext->x2 ||
+				y2 <= ext->y1 || y1 >= ext->y2)
+			continue;
+
+		glViewport(x1, y1, x2 - x1, y2 - y1);
+		glBindTexture(GL_TEXTURE_2D, tile->texture);
+		gl_draw_damage(&dst->damage, x1, y1, x2, y2);
+	}
+
+	glDisable(GL_SCISSOR_TEST);
 
 	glBindTexture(GL_TEXTURE_2D, 0);
 
+done:
+	egl_submit(dst);
+
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
 	glDeleteFramebuffers(1, &fbo.fbo);
 	glDeleteRenderbuffers(1, &fbo.rbo);
 
-	pixman_region_clear(&dst->damage);
+	pixman_region32_fini(&damage);
+	pixman_region32_clear(&dst->damage);
 }
 
 void render_av_frames_egl(struct buffer* dst, struct vnc_av_frame** src,
@@ -509,10 +1321,10 @@ void render_av_frames_egl(struct buffer* dst, struct vnc_av_frame** src,
 	struct fbo_info fbo;
 	fbo_from_gbm_bo(&fbo, dst->bo);
 
+	egl_wait_release(dst);
+
 	glBindFramebuffer(GL_FRAMEBUFFER, fbo.fbo);
 
-	struct pixman_box16* ext = pixman_region_extents(&dst->damage);
-	glScissor(ext->x1, ext->y1, ext->x2 - ext->x1, ext->y2 - ext->y1);
 	glEnable(GL_SCISSOR_TEST);
 
 	glUseProgram(shader_program_ext);
@@ -522,23 +1334,25 @@ void render_av_frames_egl(struct buffer* dst, struct vnc_av_frame** src,
 
 		int width = round((double)frame->width * scale);
 		int height = round((double)frame->height * scale);
-		glViewport(x_pos + frame->x, y_pos + frame->y, width, height);
+		int x = x_pos + frame->x;
+		int y = y_pos + frame->y;
+		glViewport(x, y, width, height);
 
 		GLuint tex = texture_from_av_frame(frame->frame);
 		glBindTexture(GL_TEXTURE_EXTERNAL_OES, tex);
 
-		gl_draw();
+		gl_draw_damage(&dst->damage, x, y, x + width, y + height);
 
 		glBindTexture(GL_TEXTURE_EXTERNAL_OES, 0);
 	}
 
 	glDisable(GL_SCISSOR_TEST);
 
-	glFlush();
+	egl_submit(dst);
 
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	glDeleteFramebuffers(1, &fbo.fbo);
 	glDeleteRenderbuffers(1, &fbo.rbo);
 
-	pixman_region_clear(&dst->damage);
+	pixman_region32_clear(&dst->damage);
 }
@@ -17,49 +17,163 @@
 #include "renderer.h"
 #include "buffer.h"
 #include "pixels.h"
+#include "work-pool.h"
 
 #include <stdbool.h>
-#include <unistd.h>
 #include <stdint.h>
+#include <string.h>
 #include <pixman.h>
 #include <assert.h>
 
-void render_image(struct buffer* dst, const struct image* src, double scale,
-		int x_pos, int y_pos)
+// Bands smaller than this aren't worth handing over to another thread
+#define RENDERER_MIN_BAND_HEIGHT 64
+
+struct render_band {
+	struct buffer* dst;
+	const struct image* src;
+	pixman_format_code_t dst_fmt, src_fmt;
+	double scale;
+	int x_pos, y_pos;
+	int y1, y2;
+};
+
+// One band for each thread of the work pool and one for the calling thread
+static struct render_band bands[WORK_POOL_MAX_THREADS + 1];
+
+/* The source is opaque and buffers match the framebuffer format, so without
+ * scaling, pixels can just be copied.
+ */
+static void copy_band(const struct render_band* band,
+		struct pixman_region32* clip)
 {
-	bool ok __attribute__((unused));
+	int bpp = PIXMAN_FORMAT_BPP(band->dst_fmt) / 8;
+	const struct image* src = band->src;
+	struct buffer* dst = band->dst;
 
-	pixman_format_code_t dst_fmt = 0;
-	ok = drm_format_to_pixman_fmt(&dst_fmt, dst->format);
-	assert(ok);
+	pixman_region32_intersect_rect(clip, clip, band->x_pos, band->y_pos,
+			src->width, src->height);
 
-	pixman_format_code_t src_fmt = 0;
-	ok = drm_format_to_pixman_fmt(&src_fmt, src->format);
-	assert(ok);
+	int n_rects = 0;
+	struct pixman_box32* box = pixman_region32_rectangles(clip, &n_rects);
+
+	for (int i = 0; i < n_rects; ++i) {
+		size_t len = (box[i].x2 - box[i].x1) * bpp;
+
+		for (int y = box[i].y1; y < box[i].y2; ++y) {
+			uint8_t* dst_row = (uint8_t*)dst->pixels +
+				y * dst->stride + box[i].x1 * bpp;
+			const uint8_t* src_row = (const uint8_t*)src->pixels +
+				(y - band->y_pos) * src->stride +
+				(box[i].x1 - band->x_pos) * bpp;
+			memcpy(dst_row, src_row, len);
+		}
+	}
+}
+
+static void composite_band(const struct render_band* band,
+		struct pixman_region32* clip)
+{
+	const struct image* src = band->src;
+	struct buffer* dst = band->dst;
 
-	pixman_image_t* dstimg = pixman_image_create_bits_no_clear(dst_fmt,
-			dst->width, dst->height, dst->pixels, dst->stride);
+	pixman_image_t* dstimg = pixman_image_create_bits_no_clear(
+			band->dst_fmt, dst->width, dst->height, dst->pixels,
+			dst->stride);
 
-	pixman_image_t* srcimg = pixman_image_create_bits_no_clear(src_fmt,
-			src->width, src->height, src->pixels, src->stride);
+	pixman_image_t* srcimg = pixman_image_create_bits_no_clear(
+			band->src_fmt, src->width, src->height, src->pixels,
+			src->stride);
 
-	pixman_fixed_t src_scale = pixman_double_to_fixed(1.0 / scale);
+	pixman_fixed_t src_scale = pixman_double_to_fixed(1.0 / band->scale);
 
 	pixman_transform_t xform;
 	pixman_transform_init_scale(&xform, src_scale, src_scale);
 	pixman_image_set_transform(srcimg, &xform);
 
-	pixman_image_set_clip_region(dstimg, &dst->damage);
+	pixman_image_set_clip_region32(dstimg, clip);
 
-	pixman_image_composite(PIXMAN_OP_OVER, srcimg, NULL, dstimg,
+	pixman_image_composite(PIXMAN_OP_SRC, srcimg, NULL, dstimg,
 			0, 0,
 			0, 0,
-			x_pos, y_pos,
+			band->x_pos, band->y_pos,
 			dst->width, dst->height);
 
 	pixman_image_unref(srcimg);
 	pixman_image_unref(dstimg);
+}
+
+static void render_band(const struct render_band* band)
+{
+	struct pixman_region32 clip;
+	pixman_region32_init(&clip);
+	pixman_region32_intersect_rect(&clip, &band->dst->damage, 0, band->y1,
+			band->dst->width, band->y2 - band->y1);
+
+	if (!pixman_region32_not_empty(&clip))
+		goto done;
+
+	if (band->scale == 1.0 && band->dst_fmt == band->src_fmt)
+		copy_band(band, &clip);
+	else
+		composite_band(band, &clip);
 
-	pixman_region_clear(&dst->damage);
+done:
+	pixman_region32_fini(&clip);
 }
 
+static void render_band_job(void* userdata, int worker)
+{
+	render_band(userdata);
+}
+
+void render_image(struct buffer* dst, const struct image* src, double scale,
+		int x_pos, int y_pos)
+{
+	bool ok __attribute__((unused));
+
+	pixman_format_code_t dst_fmt = 0;
+	ok = drm_format_to_pixman_fmt(&dst_fmt, dst->format);
+	assert(ok);
+
+	pixman_format_code_t src_fmt = 0;
+	ok = drm_format_to_pixman_fmt(&src_fmt, src->format);
+	assert(ok);
+
+	struct pixman_box32* extents = pixman_region32_extents(&dst->damage);
+	int y1 = extents->y1 > 0 ? extents->y1 : 0;
+	int y2 = extents->y2 < dst->height ? extents->y2 : dst->height;
+	if (y1 >= y2)
+		goto done;
+
+	int n_bands = (y2 - y1) / RENDERER_MIN_BAND_HEIGHT;
+	if (n_bands > work_pool_get_n_threads() + 1)
+		n_bands = work_pool_get_n_threads() + 1;
+	if (n_bands < 1)
+		n_bands = 1;
+
+	int band_height = (y2 - y1 + n_bands - 1) / n_bands;
+
+	for (int i = 0; i < n_bands; ++i) {
+		struct render_band* band = &bands[i];
+		band->dst = dst;
+		band->src = src;
+		band->dst_fmt = dst_fmt;
+		band->src_fmt = src_fmt;
+		band->scale = scale;
+		band->x_pos = x_pos;
+		band->y_pos = y_pos;
+		band->y1 = y1 + i * band_height;
+		band->y2 = band->y1 + band_height < y2 ?
+			band->y1 + band_height : y2;
+	}
+
+	// Band 0 is rendered by the calling thread
+	for (int i = 1; i < n_bands; ++i)
+		work_pool_submit(render_band_job, &bands[i]);
+
+	render_band(&bands[0]);
+	work_pool_wait();
+
+done:
+	pixman_region32_clear(&dst->damage);
+}
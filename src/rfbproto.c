@@ -163,9 +163,12 @@ static rfbBool HandleZlib8(rfbClient* client, int rx, int ry, int rw, int rh);
 static rfbBool HandleZlib16(rfbClient* client, int rx, int ry, int rw, int rh);
 static rfbBool HandleZlib32(rfbClient* client, int rx, int ry, int rw, int rh);
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
-static rfbBool HandleTight8(rfbClient* client, int rx, int ry, int rw, int rh);
-static rfbBool HandleTight16(rfbClient* client, int rx, int ry, int rw, int rh);
-static rfbBool HandleTight32(rfbClient* client, int rx, int ry, int rw, int rh);
+static rfbBool HandleTight8(rfbClient* client, int rx, int ry, int rw, int rh,
+                            rfbBool isPng);
+static rfbBool HandleTight16(rfbClient* client, int rx, int ry, int rw, int rh,
+                             rfbBool isPng);
+static rfbBool HandleTight32(rfbClient* client, int rx, int ry, int rw, int rh,
+                             rfbBool isPng);
 
 static long ReadCompactLen(rfbClient* client);
 #endif
@@ -1241,20 +1244,7 @@ rfbBool InitialiseRFBConnection(rfbClient* client)
 
 rfbBool SetFormatAndEncodings(rfbClient* client)
 {
-	assert(client->appData.encodingsString);
-
 	rfbSetPixelFormatMsg spf;
-	union {
-		char bytes[sz_rfbSetEncodingsMsg + MAX_ENCODINGS * 4];
-		rfbSetEncodingsMsg msg;
-	} buf;
-
-	rfbSetEncodingsMsg* se = &buf.msg;
-	uint32_t* encs = (uint32_t*)(&buf.bytes[sz_rfbSetEncodingsMsg]);
-	int len = 0;
-	rfbBool requestCompressLevel = FALSE;
-	rfbBool requestQualityLevel = FALSE;
-	rfbBool requestLastRectEncoding = FALSE;
 
 	if (!SupportsClient2Server(client, rfbSetPixelFormat))
 		return TRUE;
@@ -1270,6 +1260,29 @@ rfbBool SetFormatAndEncodings(rfbClient* client)
 	if (!WriteToRFBServer(client, (char*)&spf, sz_rfbSetPixelFormatMsg))
 		return FALSE;
 
+	return SendEncodings(client);
+}
+
+/*
+ * SendEncodings.
+ */
+
+rfbBool SendEncodings(rfbClient* client)
+{
+	assert(client->appData.encodingsString);
+
+	union {
+		char bytes[sz_rfbSetEncodingsMsg + MAX_ENCODINGS * 4];
+		rfbSetEncodingsMsg msg;
+	} buf;
+
+	rfbSetEncodingsMsg* se = &buf.msg;
+	uint32_t* encs = (uint32_t*)(&buf.bytes[sz_rfbSetEncodingsMsg]);
+	int len = 0;
+	rfbBool requestCompressLevel = FALSE;
+	rfbBool requestQualityLevel = FALSE;
+	rfbBool requestLastRectEncoding = FALSE;
+
 	if (!SupportsClient2Server(client, rfbSetEncodings))
 		return TRUE;
 
@@ -1305,6 +1318,17 @@ rfbBool SetFormatAndEncodings(rfbClient* client)
 				requestCompressLevel = TRUE;
 			if (client->appData.enableJPEG)
 				requestQualityLevel = TRUE;
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+		} else if (strncasecmp(encStr, "tightpng", encStrLen) == 0) {
+			encs[se->nEncodings++] =
+			        rfbClientSwap32IfLE(rfbEncodingTightPng);
+			requestLastRectEncoding = TRUE;
+			if (client->appData.compressLevel >= 0 &&
+			    client->appData.compressLevel <= 9)
+				requestCompressLevel = TRUE;
+			if (client->appData.enableJPEG)
+				requestQualityLevel = TRUE;
+#endif
 #endif
 #endif
 		} else if (strncasecmp(encStr, "hextile", encStrLen) == 0) {
@@ -1330,9 +1354,15 @@ rfbBool SetFormatAndEncodings(rfbClient* client)
 			encs[se->nEncodings++] =
 			        rfbClientSwap32IfLE(rfbEncodingZRLE);
 		} else if (strncasecmp(encStr, "zywrle", encStrLen) == 0) {
-			encs[se->nEncodings++] =
-			        rfbClientSwap32IfLE(rfbEncodingZYWRLE);
-			requestQualityLevel = TRUE;
+			/* The wavelet filter runs in place on full-resolution
+			 * framebuffer pixels. */
+			if (client->frameBufferDownscale > 1) {
+				rfbClientLog("Not requesting ZYWRLE with a reduced-resolution framebuffer\n");
+			} else {
+				encs[se->nEncodings++] =
+				        rfbClientSwap32IfLE(rfbEncodingZYWRLE);
+				requestQualityLevel = TRUE;
+			}
 #endif
 		} else if ((strncasecmp(encStr, "ultra", encStrLen) == 0) ||
 		           (strncasecmp(encStr, "ultrazip", encStrLen) == 0)) {
@@ -1395,6 +1425,11 @@ rfbBool SetFormatAndEncodings(rfbClient* client)
 		encs[se->nEncodings++] =
 		        rfbClientSwap32IfLE(rfbEncodingNewFBSize);
 
+	/* Extended Desktop Size, required for SetDesktopSize */
+	if (se->nEncodings < MAX_ENCODINGS && client->canHandleNewFBSize)
+		encs[se->nEncodings++] =
+		        rfbClientSwap32IfLE(rfbEncodingExtDesktopSize);
+
 	/* Last Rect */
 	if (se->nEncodings < MAX_ENCODINGS && requestLastRectEncoding)
 		encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingLastRect);
@@ -1457,6 +1492,9 @@ rfbBool SendFramebufferUpdateRequest(rfbClient* client, int x, int y, int w,
 		return TRUE;
 	}
 
+	if (client->updatesPaused)
+		return TRUE;
+
 	fur.type = rfbFramebufferUpdateRequest;
 	fur.incremental = incremental ? 1 : 0;
 	fur.x = rfbClientSwap16IfLE(x);
@@ -1677,10 +1715,15 @@ rfbBool SendExtDesktopSize(rfbClient* client, uint16_t width, uint16_t height)
 	if (client->screen.width != rfbClientSwap16IfLE(width) ||
 	    client->screen.height != rfbClientSwap16IfLE(height)) {
 		rfbClientLog("Sending dimensions %dx%d\n", width, height);
+		memset(&sdm, 0, sizeof(sdm));
 		sdm.type = rfbSetDesktopSize;
 		sdm.width = rfbClientSwap16IfLE(width);
 		sdm.height = rfbClientSwap16IfLE(height);
 		sdm.numberOfScreens = 1;
+		/* Keep the id and flags that the server gave us */
+		screen = client->screen;
+		screen.x = 0;
+		screen.y = 0;
 		screen.width = rfbClientSwap16IfLE(width);
 		screen.height = rfbClientSwap16IfLE(height);
 
@@ -1840,7 +1883,6 @@ static rfbBool HandleFramebufferUpdate(rfbClient* client,
 			/* read encoding data */
 			int screens;
 			int loop;
-			rfbBool invalidScreen = FALSE;
 			rfbExtDesktopScreen screen;
 			rfbExtDesktopSizeMsg eds;
 			if (!ReadFromRFBServer(client, ((char*)&eds),
@@ -1854,15 +1896,17 @@ static rfbBool HandleFramebufferUpdate(rfbClient* client,
 				                       sz_rfbExtDesktopScreen)) {
 					goto failure;
 				}
-				if (screen.id != 0) {
+				if (loop == 0)
 					client->screen = screen;
-				} else {
-					invalidScreen = TRUE;
-				}
 			}
 
-			if (!invalidScreen && (client->width != rect.r.w ||
-			                       client->height != rect.r.h)) {
+			if (rect.r.x == rfbExtDesktopSize_ClientRequestedChange &&
+			    rect.r.y != rfbExtDesktopSize_Success)
+				rfbClientLog("Server rejected desktop size "
+				             "change: %d\n", rect.r.y);
+
+			if (screens > 0 && (client->width != rect.r.w ||
+			                    client->height != rect.r.h)) {
 				if (!ResizeClientBuffer(client, rect.r.w,
 				                        rect.r.h)) {
 					goto failure;
@@ -2235,21 +2279,26 @@ static rfbBool HandleFramebufferUpdate(rfbClient* client,
 		}
 
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+		case rfbEncodingTightPng:
+#endif
 		case rfbEncodingTight: {
+			rfbBool isPng = rect.encoding == rfbEncodingTightPng;
+
 			switch (client->format.bitsPerPixel) {
 			case 8:
 				if (!HandleTight8(client, rect.r.x, rect.r.y,
-				                  rect.r.w, rect.r.h))
+				                  rect.r.w, rect.r.h, isPng))
 					goto failure;
 				break;
 			case 16:
 				if (!HandleTight16(client, rect.r.x, rect.r.y,
-				                   rect.r.w, rect.r.h))
+				                   rect.r.w, rect.r.h, isPng))
 					goto failure;
 				break;
 			case 32:
 				if (!HandleTight32(client, rect.r.x, rect.r.y,
-				                   rect.r.w, rect.r.h))
+				                   rect.r.w, rect.r.h, isPng))
 					goto failure;
 				break;
 			}
@@ -2590,7 +2639,46 @@ rfbBool HandleRFBServerMessage(rfbClient* client)
 #define CONCAT3(a, b, c) a##b##c
 #define CONCAT3E(a, b, c) CONCAT3(a, b, c)
 
+#if defined(LIBVNCSERVER_HAVE_LIBZ) && defined(LIBVNCSERVER_HAVE_LIBJPEG)
+static rfbBool AllocStagingBuffer(rfbClient* client, size_t size)
+{
+	uint8_t* buffer;
+
+	if (client->stagingBufferSize >= size)
+		return TRUE;
+
+	buffer = realloc(client->stagingBuffer, size);
+	if (!buffer) {
+		rfbClientErr("Failed to allocate %zu byte staging buffer\n", size);
+		return FALSE;
+	}
+
+	client->stagingBuffer = buffer;
+	client->stagingBufferSize = size;
+	return TRUE;
+}
+
+static rfbBool AllocTightPrevRow(rfbClient* client, size_t size)
+{
+	uint8_t* buffer;
+
+	if (client->tightPrevRowSize >= size)
+		return TRUE;
+
+	buffer = realloc(client->tightPrevRow, size);
+	if (!buffer) {
+		rfbClientErr("Failed to allocate %zu byte gradient row\n", size);
+		return FALSE;
+	}
+
+	client->tightPrevRow = buffer;
+	client->tightPrevRowSize = size;
+	return TRUE;
+}
+#endif
+
 #define BPP 8
+#include "palette.c"
 #include "rre.c"
 #include "corre.c"
 #include "hextile.c"
@@ -2601,6 +2689,7 @@ rfbBool HandleRFBServerMessage(rfbClient* client)
 #include "zrle.c"
 #undef BPP
 #define BPP 16
+#include "palette.c"
 #include "rre.c"
 #include "corre.c"
 #include "hextile.c"
@@ -2615,6 +2704,7 @@ rfbBool HandleRFBServerMessage(rfbClient* client)
 #include "zrle.c"
 #undef BPP
 #define BPP 32
+#include "palette.c"
 #include "rre.c"
 #include "corre.c"
 #include "hextile.c"
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "sync-timeline.h"
+#include "linux-drm-syncobj-v1.h"
+#include "time-util.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include <xf86drm.h>
+
+struct sync_timeline* sync_timeline_create(int drm_fd,
+		struct wp_linux_drm_syncobj_manager_v1* manager)
+{
+	struct sync_timeline* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->drm_fd = drm_fd;
+
+	if (drmSyncobjCreate(drm_fd, 0, &self->handle) != 0)
+		goto handle_failure;
+
+	if (drmSyncobjCreate(drm_fd, 0, &self->staging) != 0)
+		goto staging_failure;
+
+	int fd = -1;
+	if (drmSyncobjHandleToFD(drm_fd, self->handle, &fd) != 0)
+		goto fd_failure;
+
+	self->wl_timeline = wp_linux_drm_syncobj_manager_v1_import_timeline(
+			manager, fd);
+	close(fd);
+	if (!self->wl_timeline)
+		goto fd_failure;
+
+	return self;
+
+fd_failure:
+	drmSyncobjDestroy(drm_fd, self->staging);
+staging_failure:
+	drmSyncobjDestroy(drm_fd, self->handle);
+handle_failure:
+	free(self);
+	return NULL;
+}
+
+void sync_timeline_destroy(struct sync_timeline* self)
+{
+	if (!self)
+		return;
+
+	wp_linux_drm_syncobj_timeline_v1_destroy(self->wl_timeline);
+	drmSyncobjDestroy(self->drm_fd, self->staging);
+	drmSyncobjDestroy(self->drm_fd, self->handle);
+	free(self);
+}
+
+uint64_t sync_timeline_next_point(struct sync_timeline* self)
+{
+	return ++self->point;
+}
+
+bool sync_timeline_is_signalled(struct sync_timeline* self, uint64_t point)
+{
+	uint64_t value = 0;
+	if (drmSyncobjQuery(self->drm_fd, &self->handle, &value, 1) != 0)
+		return false;
+
+	return value >= point;
+}
+
+int sync_timeline_signal(struct sync_timeline* self, uint64_t point)
+{
+	return drmSyncobjTimelineSignal(self->drm_fd, &self->handle, &point, 1);
+}
+
+/* The fd is not consumed.
+ */
+int sync_timeline_import_sync_file(struct sync_timeline* self, uint64_t point,
+		int fd)
+{
+	if (drmSyncobjImportSyncFile(self->drm_fd, self->staging, fd) != 0)
+		return -1;
+
+	return drmSyncobjTransfer(self->drm_fd, self->handle, point,
+			self->staging, 0, 0);
+}
+
+// Whether a fence has been attached to the point yet
+bool sync_timeline_is_available(struct sync_timeline* self, uint64_t point)
+{
+	return drmSyncobjTimelineWait(self->drm_fd, &self->handle, &point, 1,
+			0, DRM_SYNCOBJ_WAIT_FLAGS_WAIT_AVAILABLE, NULL) == 0;
+}
+
+/* Returns a sync file that signals along with the point, or -1 if no fence has
+ * been attached to the point within the timeout.
+ */
+int sync_timeline_export_sync_file(struct sync_timeline* self, uint64_t point,
+		int timeout_ms)
+{
+	int64_t deadline = timeout_ms > 0 ?
+		gettime_us() * 1000 + timeout_ms * INT64_C(1000000) : 0;
+
+	if (drmSyncobjTimelineWait(self->drm_fd, &self->handle, &point, 1,
+				deadline, DRM_SYNCOBJ_WAIT_FLAGS_WAIT_AVAILABLE,
+				NULL) != 0)
+		return -1;
+
+	if (drmSyncobjTransfer(self->drm_fd, self->staging, 0, self->handle,
+				point, 0) != 0)
+		return -1;
+
+	int fd = -1;
+	if (drmSyncobjExportSyncFile(self->drm_fd, self->staging, &fd) != 0)
+		return -1;
+
+	return fd;
+}
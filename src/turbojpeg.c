@@ -56,7 +56,9 @@
 
 /* Error handling (based on example in example.c) */
 
-static char errStr[JMSG_LENGTH_MAX]="No error";
+/* Handles are used from several threads at once by the JPEG decoding pool, so
+   each thread keeps its own error message. */
+static _Thread_local char errStr[JMSG_LENGTH_MAX]="No error";
 
 struct my_error_mgr
 {
@@ -849,6 +851,135 @@ DLLEXPORT int DLLCALL tjDecompress2(tjhandle handle, unsigned char *jpegBuf,
 	return retval;
 }
 
+DLLEXPORT int DLLCALL tjPlaneWidth(int componentID, int width, int subsamp)
+{
+	int pw, nc, retval=0;
+
+	if(width<1 || subsamp<0 || subsamp>=NUMSUBOPT)
+		_throw("tjPlaneWidth(): Invalid argument");
+	nc=(subsamp==TJSAMP_GRAY? 1:3);
+	if(componentID<0 || componentID>=nc)
+		_throw("tjPlaneWidth(): Invalid argument");
+
+	pw=PAD(width, tjMCUWidth[subsamp]/8);
+	if(componentID==0) retval=pw;
+	else retval=pw*8/tjMCUWidth[subsamp];
+
+	bailout:
+	return retval;
+}
+
+DLLEXPORT int DLLCALL tjPlaneHeight(int componentID, int height, int subsamp)
+{
+	int ph, nc, retval=0;
+
+	if(height<1 || subsamp<0 || subsamp>=NUMSUBOPT)
+		_throw("tjPlaneHeight(): Invalid argument");
+	nc=(subsamp==TJSAMP_GRAY? 1:3);
+	if(componentID<0 || componentID>=nc)
+		_throw("tjPlaneHeight(): Invalid argument");
+
+	ph=PAD(height, tjMCUHeight[subsamp]/8);
+	if(componentID==0) retval=ph;
+	else retval=ph*8/tjMCUHeight[subsamp];
+
+	bailout:
+	return retval;
+}
+
+/* libjpeg's raw data mode hands out whole iMCU rows of DCT blocks, which may
+   be wider and taller than the planes, so they are decoded into a scratch
+   buffer and copied from there. */
+
+DLLEXPORT int DLLCALL tjDecompressToYUVPlanes(tjhandle handle,
+	unsigned char *jpegBuf, unsigned long jpegSize, unsigned char **dstPlanes,
+	int width, int *strides, int height, int flags)
+{
+	int i, j, row, retval=0, subsamp, nc;
+	int pw[MAX_COMPONENTS], ph[MAX_COMPONENTS];
+	JSAMPROW *rows[MAX_COMPONENTS]={NULL};
+	JSAMPLE *scratch[MAX_COMPONENTS]={NULL};
+	JSAMPARRAY yuvptr[MAX_COMPONENTS];
+
+	getinstance(handle);
+	if((this->init&DECOMPRESS)==0)
+		_throw("tjDecompressToYUVPlanes(): Instance has not been initialized for decompression");
+
+	if(jpegBuf==NULL || jpegSize<=0 || dstPlanes==NULL || !dstPlanes[0]
+		|| width<0 || height<0)
+		_throw("tjDecompressToYUVPlanes(): Invalid argument");
+
+	if(setjmp(this->jerr.setjmp_buffer))
+	{
+		/* If we get here, the JPEG code has signaled an error. */
+		retval=-1;
+		goto bailout;
+	}
+
+	this->jsrc.bytes_in_buffer=jpegSize;
+	this->jsrc.next_input_byte=jpegBuf;
+	jpeg_read_header(dinfo, TRUE);
+
+	if((subsamp=getSubsamp(dinfo))<0)
+		_throw("tjDecompressToYUVPlanes(): Could not determine subsampling type for JPEG image");
+	nc=(subsamp==TJSAMP_GRAY? 1:3);
+	if(nc==3 && dinfo->jpeg_color_space!=JCS_YCbCr)
+		_throw("tjDecompressToYUVPlanes(): JPEG image is not in the YCbCr colorspace");
+	if((width!=0 && width!=(int)dinfo->image_width)
+		|| (height!=0 && height!=(int)dinfo->image_height))
+		_throw("tjDecompressToYUVPlanes(): Scaling is not supported");
+	width=dinfo->image_width;  height=dinfo->image_height;
+
+	for(i=0; i<nc; i++)
+	{
+		jpeg_component_info *compptr=&dinfo->comp_info[i];
+		int rowwidth=compptr->width_in_blocks*DCTSIZE;
+		int nrows=compptr->v_samp_factor*DCTSIZE;
+
+		if(!dstPlanes[i])
+			_throw("tjDecompressToYUVPlanes(): Invalid argument");
+		pw[i]=tjPlaneWidth(i, width, subsamp);
+		ph[i]=tjPlaneHeight(i, height, subsamp);
+
+		if((scratch[i]=(JSAMPLE *)malloc(rowwidth*nrows))==NULL
+			|| (rows[i]=(JSAMPROW *)malloc(sizeof(JSAMPROW)*nrows))==NULL)
+			_throw("tjDecompressToYUVPlanes(): Memory allocation failure");
+		for(j=0; j<nrows; j++) rows[i][j]=&scratch[i][j*rowwidth];
+		yuvptr[i]=rows[i];
+	}
+
+	dinfo->raw_data_out=TRUE;
+	dinfo->do_fancy_upsampling=FALSE;
+	jpeg_start_decompress(dinfo);
+
+	for(row=0; row<(int)dinfo->output_height;
+		row+=dinfo->max_v_samp_factor*DCTSIZE)
+	{
+		jpeg_read_raw_data(dinfo, yuvptr, dinfo->max_v_samp_factor*DCTSIZE);
+
+		for(i=0; i<nc; i++)
+		{
+			jpeg_component_info *compptr=&dinfo->comp_info[i];
+			int stride=strides && strides[i]>0? strides[i]:pw[i];
+			int crow=row*compptr->v_samp_factor/dinfo->max_v_samp_factor;
+
+			for(j=0; j<compptr->v_samp_factor*DCTSIZE && crow+j<ph[i]; j++)
+				memcpy(&dstPlanes[i][(crow+j)*stride], rows[i][j], pw[i]);
+		}
+	}
+	jpeg_finish_decompress(dinfo);
+
+	bailout:
+	if(dinfo->global_state>DSTATE_START) jpeg_abort_decompress(dinfo);
+	for(i=0; i<MAX_COMPONENTS; i++)
+	{
+		if(rows[i]) free(rows[i]);
+		if(scratch[i]) free(scratch[i]);
+	}
+	(void)flags;
+	return retval;
+}
+
 DLLEXPORT int DLLCALL tjDecompress(tjhandle handle, unsigned char *jpegBuf,
 	unsigned long jpegSize, unsigned char *dstBuf, int width, int pitch,
 	int height, int pixelSize, int flags)
@@ -24,18 +24,30 @@
 #include <libdrm/drm_fourcc.h>
 #include <libavutil/frame.h>
 #include <stdio.h>
+#include <aml.h>
 #include <data-control.h>
 
 #include "rfbclient.h"
 #include "vnc.h"
 #include "open-h264.h"
 #include "usdt.h"
+#include "time-util.h"
+
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+#include "turbojpeg.h"
+#endif
 
 #define RFB_ENCODING_OPEN_H264 50
 #define RFB_ENCODING_PTS -1000
 
 #define NO_PTS UINT64_MAX
 
+/* If the server keeps sending lossy data after JPEG has been disabled, give up
+ * on the refinement after this many updates and turn JPEG back on.
+ */
+#define LOSSLESS_REFRESH_MAX_UPDATES 4
+#define LOSSLESS_REFRESH_MAX_RECTS 16
+
 extern const unsigned short code_map_linux_to_qnum[];
 extern const unsigned int code_map_linux_to_qnum_len;
 
@@ -63,27 +75,640 @@ static void vnc_client_unlock_handler(struct vnc_client* self)
 	self->handler_lock = false;
 }
 
+static void vnc_client_jpeg_rect_destroy(struct vnc_client* self,
+		struct vnc_jpeg_rect* rect)
+{
+	wl_list_remove(&rect->link);
+	self->n_jpeg_rects--;
+
+	for (int i = 0; i < 3; ++i)
+		free(rect->planes[i]);
+
+	pixman_region32_fini(&rect->stale);
+	free(rect->data);
+	free(rect);
+}
+
+static void vnc_client_complete_jpeg_rects(struct vnc_client* self);
+
+static void vnc_client_destroy_jpeg_rects(struct vnc_client* self)
+{
+	struct vnc_jpeg_rect* rect;
+	struct vnc_jpeg_rect* tmp;
+
+	vnc_client_complete_jpeg_rects(self);
+
+	wl_list_for_each_safe(rect, tmp, &self->jpeg_rects, link)
+		vnc_client_jpeg_rect_destroy(self, rect);
+
+	self->n_yuv_rects = 0;
+	pixman_region32_clear(&self->stale_region);
+}
+
+// Rects that are neither stale nor waiting to be drawn are of no further use
+static void vnc_client_prune_jpeg_rects(struct vnc_client* self)
+{
+	struct vnc_jpeg_rect* rect;
+	struct vnc_jpeg_rect* tmp;
+	wl_list_for_each_safe(rect, tmp, &self->jpeg_rects, link)
+		if (!rect->is_pending && !rect->planes[0] &&
+				!pixman_region32_not_empty(&rect->stale))
+			vnc_client_jpeg_rect_destroy(self, rect);
+}
+
+/* Pixels that have been written to the framebuffer since are no longer
+ * missing.
+ */
+static void vnc_client_refresh_stale(struct vnc_client* self, int x, int y,
+		int width, int height)
+{
+	struct pixman_box32 box = {
+		.x1 = x,
+		.y1 = y,
+		.x2 = x + width,
+		.y2 = y + height,
+	};
+
+	if (pixman_region32_contains_rectangle(&self->stale_region, &box) ==
+			PIXMAN_REGION_OUT)
+		return;
+
+	struct pixman_region32 rect_region;
+	pixman_region32_init_rect(&rect_region, x, y, width, height);
+
+	struct vnc_jpeg_rect* rect;
+	wl_list_for_each(rect, &self->jpeg_rects, link)
+		pixman_region32_subtract(&rect->stale, &rect->stale,
+				&rect_region);
+
+	pixman_region32_subtract(&self->stale_region, &self->stale_region,
+			&rect_region);
+	pixman_region32_fini(&rect_region);
+}
+
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+static tjhandle vnc_client_get_tjhnd(struct vnc_client* self)
+{
+	if (!self->tjhnd)
+		self->tjhnd = tjInitDecompress();
+	return self->tjhnd;
+}
+
+// Same as the Tight decoder's
+static int vnc_client_tj_flags(const rfbClient* client)
+{
+	int flags = 0;
+	if (client->format.bigEndian)
+		flags |= TJ_ALPHAFIRST;
+	if (client->format.redShift == 16 && client->format.blueShift == 0)
+		flags |= TJ_BGR;
+	if (client->format.bigEndian)
+		flags ^= TJ_BGR;
+	return flags;
+}
+
+/* Decodes the rect on the CPU, into the parts of the framebuffer where it is
+ * still missing.
+ */
+static int vnc_client_resolve_jpeg_rect(struct vnc_client* self,
+		struct vnc_jpeg_rect* rect)
+{
+	rfbClient* client = self->client;
+	int rc = -1;
+
+	if (!pixman_region32_not_empty(&rect->stale))
+		return 0;
+
+	tjhandle tjhnd = vnc_client_get_tjhnd(self);
+	int pitch = rect->width * 4;
+	uint8_t* pixels = malloc(pitch * rect->height);
+	if (!tjhnd || !pixels)
+		goto done;
+
+	if (tjDecompress(tjhnd, rect->data, rect->length, pixels,
+				rect->width, pitch, rect->height, 4,
+				vnc_client_tj_flags(client)) == -1) {
+		rfbClientLog("TurboJPEG error: %s\n", tjGetErrorStr());
+		goto done;
+	}
+
+	int stride = vnc_client_get_stride(self);
+	int n_boxes = 0;
+	struct pixman_box32* boxes = pixman_region32_rectangles(&rect->stale,
+			&n_boxes);
+
+	for (int i = 0; i < n_boxes; ++i) {
+		size_t len = (boxes[i].x2 - boxes[i].x1) * 4;
+
+		for (int y = boxes[i].y1; y < boxes[i].y2; ++y)
+			memcpy(client->frameBuffer + y * stride +
+					boxes[i].x1 * 4,
+					pixels + (y - rect->y) * pitch +
+					(boxes[i].x1 - rect->x) * 4, len);
+	}
+
+	rc = 0;
+done:
+	free(pixels);
+	pixman_region32_subtract(&self->stale_region, &self->stale_region,
+			&rect->stale);
+	pixman_region32_clear(&rect->stale);
+	return rc;
+}
+#else
+static int vnc_client_resolve_jpeg_rect(struct vnc_client* self,
+		struct vnc_jpeg_rect* rect)
+{
+	return -1;
+}
+#endif
+
+/* Brings the framebuffer up to date within the given rectangle, before it is
+ * read from.
+ */
+static void vnc_client_resolve_stale(struct vnc_client* self, int x, int y,
+		int width, int height)
+{
+	struct pixman_box32 box = {
+		.x1 = x,
+		.y1 = y,
+		.x2 = x + width,
+		.y2 = y + height,
+	};
+
+	if (pixman_region32_contains_rectangle(&self->stale_region, &box) ==
+			PIXMAN_REGION_OUT)
+		return;
+
+	struct vnc_jpeg_rect* rect;
+	wl_list_for_each(rect, &self->jpeg_rects, link)
+		if (pixman_region32_contains_rectangle(&rect->stale, &box) !=
+				PIXMAN_REGION_OUT)
+			vnc_client_resolve_jpeg_rect(self, rect);
+}
+
+static void vnc_client_drop_yuv_rect(struct vnc_client* self,
+		struct vnc_jpeg_rect* rect)
+{
+	for (int i = 0; i < self->n_yuv_rects; ++i) {
+		if (self->yuv_rects[i] != rect)
+			continue;
+
+		memmove(&self->yuv_rects[i], &self->yuv_rects[i + 1],
+				(self->n_yuv_rects - i - 1) *
+				sizeof(self->yuv_rects[0]));
+		self->n_yuv_rects--;
+		break;
+	}
+
+	for (int i = 0; i < 3; ++i) {
+		free(rect->planes[i]);
+		rect->planes[i] = NULL;
+	}
+}
+
+/* Waits for the JPEG pool to finish the rects of the current update. Rects
+ * that couldn't be decoded into YUV planes are decoded again on the CPU. If a
+ * rect can't be decoded at all, the update fails, just like it would have if
+ * the rect had been decoded inline; vnc_client_process() reports it.
+ */
+static void vnc_client_complete_jpeg_rects(struct vnc_client* self)
+{
+	if (!pixman_region32_not_empty(&self->pending_region))
+		return;
+
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+	jpeg_pool_wait();
+#endif
+
+	struct vnc_jpeg_rect* rect;
+	wl_list_for_each(rect, &self->jpeg_rects, link) {
+		if (!rect->is_pending)
+			continue;
+
+		rect->is_pending = false;
+
+		if (rect->job.result >= 0)
+			continue;
+
+		if (rect->planes[0]) {
+			vnc_client_drop_yuv_rect(self, rect);
+			if (vnc_client_resolve_jpeg_rect(self, rect) == 0)
+				continue;
+		}
+
+		rfbClientLog("Failed to decode JPEG rect %dx%d at (%d, %d)\n",
+				rect->width, rect->height, rect->x, rect->y);
+		self->is_jpeg_failed = true;
+	}
+
+	pixman_region32_clear(&self->pending_region);
+	vnc_client_prune_jpeg_rects(self);
+}
+
+static void vnc_client_resolve_all(struct vnc_client* self)
+{
+	struct vnc_jpeg_rect* rect;
+
+	vnc_client_complete_jpeg_rects(self);
+
+	wl_list_for_each(rect, &self->jpeg_rects, link)
+		vnc_client_resolve_jpeg_rect(self, rect);
+
+	vnc_client_prune_jpeg_rects(self);
+}
+
+void vnc_client_clear_yuv_rects(struct vnc_client* self)
+{
+	for (int i = 0; i < self->n_yuv_rects; ++i) {
+		struct vnc_jpeg_rect* rect = self->yuv_rects[i];
+
+		for (int j = 0; j < 3; ++j) {
+			free(rect->planes[j]);
+			rect->planes[j] = NULL;
+		}
+	}
+	self->n_yuv_rects = 0;
+
+	vnc_client_prune_jpeg_rects(self);
+}
+
+/* For renderers that were handed a YUV rect but can't convert it after all.
+ * The rect stays in the list until the frame has been presented.
+ */
+int vnc_client_resolve_yuv_rect(struct vnc_client* self,
+		struct vnc_jpeg_rect* rect)
+{
+	return vnc_client_resolve_jpeg_rect(self, rect);
+}
+
 static rfbBool vnc_client_alloc_fb(rfbClient* client)
 {
 	struct vnc_client* self = rfbClientGetClientData(client, NULL);
 	assert(self);
 
+	pixman_region32_clear(&self->lossy_region);
+	pixman_region32_clear(&self->refine_region);
+	vnc_client_destroy_jpeg_rects(self);
+
+	if (dirty_tiles_resize(&self->damage, vnc_client_get_width(self),
+				vnc_client_get_height(self)) < 0)
+		return FALSE;
+
 	return self->alloc_fb(self) < 0 ? FALSE : TRUE;
 }
 
+static void vnc_client_got_lossy_rect(rfbClient* client, int x, int y,
+		int width, int height)
+{
+	struct vnc_client* self = rfbClientGetClientData(client, NULL);
+	assert(self);
+
+	self->current_rect_is_lossy = true;
+}
+
+static void vnc_client_track_lossy_rect(struct vnc_client* self, int x, int y,
+		int width, int height)
+{
+	bool is_lossy = self->current_rect_is_lossy;
+	self->current_rect_is_lossy = false;
+
+	if (self->is_current_rect_tracked) {
+		self->is_current_rect_tracked = false;
+		return;
+	}
+
+	if (!self->lossless_refresh_delay)
+		return;
+
+	if (is_lossy) {
+		pixman_region32_union_rect(&self->lossy_region,
+				&self->lossy_region, x, y, width, height);
+		self->is_lossy_region_damaged = true;
+		return;
+	}
+
+	struct pixman_box32 box = {
+		.x1 = x,
+		.y1 = y,
+		.x2 = x + width,
+		.y2 = y + height,
+	};
+
+	if (pixman_region32_contains_rectangle(&self->lossy_region, &box) ==
+			PIXMAN_REGION_OUT)
+		return;
+
+	struct pixman_region32 rect;
+	pixman_region32_init_rect(&rect, x, y, width, height);
+	pixman_region32_subtract(&self->lossy_region, &self->lossy_region, &rect);
+	pixman_region32_subtract(&self->refine_region, &self->refine_region,
+			&rect);
+	pixman_region32_fini(&rect);
+
+	self->is_lossy_region_damaged = true;
+}
+
+static void vnc_client_copy_region(struct pixman_region32* region,
+		int src_x, int src_y, int width, int height, int dst_x,
+		int dst_y)
+{
+	struct pixman_region32 copied, dst;
+	pixman_region32_init_rect(&copied, src_x, src_y, width, height);
+	pixman_region32_intersect(&copied, &copied, region);
+	pixman_region32_translate(&copied, dst_x - src_x, dst_y - src_y);
+
+	pixman_region32_init_rect(&dst, dst_x, dst_y, width, height);
+	pixman_region32_subtract(region, region, &dst);
+	pixman_region32_union(region, region, &copied);
+
+	pixman_region32_fini(&dst);
+	pixman_region32_fini(&copied);
+}
+
+/* A copy carries whatever was lossy about its source over to its destination,
+ * rather than making the destination lossless.
+ */
+static void vnc_client_track_lossy_copy(struct vnc_client* self, int src_x,
+		int src_y, int width, int height, int dst_x, int dst_y)
+{
+	self->is_current_rect_tracked = true;
+
+	if (!self->lossless_refresh_delay)
+		return;
+
+	struct pixman_box32 src = {
+		.x1 = src_x,
+		.y1 = src_y,
+		.x2 = src_x + width,
+		.y2 = src_y + height,
+	};
+	struct pixman_box32 dst = {
+		.x1 = dst_x,
+		.y1 = dst_y,
+		.x2 = dst_x + width,
+		.y2 = dst_y + height,
+	};
+
+	if (pixman_region32_contains_rectangle(&self->lossy_region, &src) ==
+			PIXMAN_REGION_OUT &&
+			pixman_region32_contains_rectangle(&self->lossy_region,
+				&dst) == PIXMAN_REGION_OUT)
+		return;
+
+	vnc_client_copy_region(&self->lossy_region, src_x, src_y, width,
+			height, dst_x, dst_y);
+	vnc_client_copy_region(&self->refine_region, src_x, src_y, width,
+			height, dst_x, dst_y);
+
+	self->is_lossy_region_damaged = true;
+}
+
+/* Forgets about the rect that was being decoded, in case it never made it to
+ * vnc_client_update_box().
+ */
+static void vnc_client_reset_lossy_rect(struct vnc_client* self)
+{
+	self->current_rect_is_lossy = false;
+	self->is_current_rect_tracked = false;
+}
+
+/* Maps a rectangle in desktop coordinates onto the smallest rectangle that
+ * covers it in the reduced framebuffer.
+ */
+static void vnc_client_reduce_rect(const struct vnc_client* self, int* x,
+		int* y, int* width, int* height)
+{
+	int k = self->decode_scale;
+	int x2 = (*x + *width + k - 1) / k;
+	int y2 = (*y + *height + k - 1) / k;
+
+	*x /= k;
+	*y /= k;
+	*width = x2 - *x;
+	*height = y2 - *y;
+}
+
 static void vnc_client_update_box(rfbClient* client, int x, int y, int width,
 		int height)
 {
 	struct vnc_client* self = rfbClientGetClientData(client, NULL);
 	assert(self);
 
+	vnc_client_track_lossy_rect(self, x, y, width, height);
+
+	if (self->current_rect_is_yuv)
+		self->current_rect_is_yuv = false;
+	else if (self->decode_scale == 1)
+		vnc_client_refresh_stale(self, x, y, width, height);
+
 	if (self->current_rect_is_av_frame) {
 		self->current_rect_is_av_frame = false;
 		return;
 	}
 
-	pixman_region_union_rect(&self->damage, &self->damage, x, y, width,
-			height);
+	if (self->current_rect_is_copy) {
+		self->current_rect_is_copy = false;
+		return;
+	}
+
+	vnc_client_reduce_rect(self, &x, &y, &width, &height);
+	dirty_tiles_mark(&self->damage, x, y, width, height);
+}
+
+/* Box filter: each reduced pixel becomes the average of the pixels of its
+ * k×k block that are covered by the rectangle. Blocks that straddle the
+ * rectangle edge are therefore only approximated until their neighbours are
+ * also updated.
+ */
+static void vnc_client_reduce_bitmap(rfbClient* client, const uint8_t* buffer,
+		int x, int y, int width, int height)
+{
+	struct vnc_client* self = rfbClientGetClientData(client, NULL);
+	assert(self);
+
+	int k = self->decode_scale;
+	int stride = vnc_client_get_width(self);
+	uint32_t* dst = (uint32_t*)client->frameBuffer;
+	const uint32_t* src = (const uint32_t*)buffer;
+
+	int rx = x, ry = y, rw = width, rh = height;
+	vnc_client_reduce_rect(self, &rx, &ry, &rw, &rh);
+
+	for (int dy = ry; dy < ry + rh; ++dy) {
+		int sy0 = dy * k > y ? dy * k - y : 0;
+		int sy1 = (dy + 1) * k < y + height ? (dy + 1) * k - y : height;
+
+		for (int dx = rx; dx < rx + rw; ++dx) {
+			int sx0 = dx * k > x ? dx * k - x : 0;
+			int sx1 = (dx + 1) * k < x + width ?
+				(dx + 1) * k - x : width;
+
+			uint32_t sum[4] = { 0 };
+			for (int sy = sy0; sy < sy1; ++sy)
+				for (int sx = sx0; sx < sx1; ++sx) {
+					uint32_t p = src[sy * width + sx];
+					sum[0] += p & 0xff;
+					sum[1] += (p >> 8) & 0xff;
+					sum[2] += (p >> 16) & 0xff;
+					sum[3] += p >> 24;
+				}
+
+			uint32_t n = (sy1 - sy0) * (sx1 - sx0);
+			dst[dy * stride + dx] = (sum[0] / n) |
+				(sum[1] / n) << 8 |
+				(sum[2] / n) << 16 |
+				(sum[3] / n) << 24;
+		}
+	}
+}
+
+static void vnc_client_reduce_fill(rfbClient* client, int x, int y,
+		int width, int height, uint32_t colour)
+{
+	struct vnc_client* self = rfbClientGetClientData(client, NULL);
+	assert(self);
+
+	int stride = vnc_client_get_width(self);
+	uint32_t* dst = (uint32_t*)client->frameBuffer;
+
+	vnc_client_reduce_rect(self, &x, &y, &width, &height);
+
+	for (int j = y; j < y + height; ++j)
+		for (int i = x; i < x + width; ++i)
+			dst[j * stride + i] = colour;
+}
+
+static void vnc_client_reduce_copy(rfbClient* client, int src_x, int src_y,
+		int width, int height, int dst_x, int dst_y)
+{
+	struct vnc_client* self = rfbClientGetClientData(client, NULL);
+	assert(self);
+
+	int k = self->decode_scale;
+	int stride = vnc_client_get_width(self);
+	int fb_height = vnc_client_get_height(self);
+	uint32_t* fb = (uint32_t*)client->frameBuffer;
+
+	vnc_client_reduce_rect(self, &dst_x, &dst_y, &width, &height);
+	src_x /= k;
+	src_y /= k;
+
+	if (src_x + width > stride)
+		width = stride - src_x;
+	if (src_y + height > fb_height)
+		height = fb_height - src_y;
+
+	if (src_y < dst_y) {
+		for (int j = height - 1; j >= 0; --j)
+			memmove(fb + (dst_y + j) * stride + dst_x,
+					fb + (src_y + j) * stride + src_x,
+					width * sizeof(*fb));
+	} else {
+		for (int j = 0; j < height; ++j)
+			memmove(fb + (dst_y + j) * stride + dst_x,
+					fb + (src_y + j) * stride + src_x,
+					width * sizeof(*fb));
+	}
+}
+
+static void vnc_client_refine_lossy_region(struct vnc_client* self)
+{
+	rfbClient* client = self->client;
+
+	if (!client->appData.enableJPEG)
+		return;
+
+	/* Leaving out the quality pseudo-encoding makes the server fall back
+	 * to lossless compression until JPEG is enabled again.
+	 */
+	client->appData.enableJPEG = FALSE;
+	if (!SendEncodings(client)) {
+		client->appData.enableJPEG = TRUE;
+		return;
+	}
+
+	pixman_region32_copy(&self->refine_region, &self->lossy_region);
+
+	int n_rects = 0;
+	struct pixman_box32* box =
+		pixman_region32_rectangles(&self->refine_region, &n_rects);
+
+	if (n_rects > LOSSLESS_REFRESH_MAX_RECTS) {
+		box = pixman_region32_extents(&self->refine_region);
+		n_rects = 1;
+	}
+
+	for (int i = 0; i < n_rects; ++i)
+		SendFramebufferUpdateRequest(client, box[i].x1, box[i].y1,
+				box[i].x2 - box[i].x1, box[i].y2 - box[i].y1,
+				FALSE);
+
+	self->is_refining = true;
+	self->refine_countdown = LOSSLESS_REFRESH_MAX_UPDATES;
+}
+
+static void vnc_client_schedule_lossless_refresh(struct vnc_client* self,
+		uint64_t timeout)
+{
+	struct aml* aml = aml_get_default();
+
+	if (self->is_lossless_refresh_pending)
+		return;
+
+	if (!self->lossless_refresh_timer)
+		return;
+
+	aml_timer_set_duration(self->lossless_refresh_timer, timeout);
+	if (aml_start(aml, self->lossless_refresh_timer) == 0)
+		self->is_lossless_refresh_pending = true;
+}
+
+static void on_lossless_refresh_timeout(void* obj)
+{
+	struct vnc_client* self = aml_get_userdata(obj);
+	assert(self);
+
+	self->is_lossless_refresh_pending = false;
+
+	if (self->is_refining || !pixman_region32_not_empty(&self->lossy_region))
+		return;
+
+	uint64_t now = gettime_us();
+	uint64_t deadline = self->last_lossy_damage +
+		self->lossless_refresh_delay;
+
+	if (now < deadline) {
+		vnc_client_schedule_lossless_refresh(self, deadline - now);
+		return;
+	}
+
+	vnc_client_refine_lossy_region(self);
+}
+
+static void vnc_client_finish_lossy_tracking(struct vnc_client* self)
+{
+	if (!self->lossless_refresh_delay)
+		return;
+
+	if (self->is_refining && (--self->refine_countdown <= 0 ||
+				!pixman_region32_not_empty(&self->refine_region))) {
+		self->is_refining = false;
+		pixman_region32_clear(&self->refine_region);
+
+		self->client->appData.enableJPEG = TRUE;
+		SendEncodings(self->client);
+	}
+
+	if (!self->is_lossy_region_damaged)
+		return;
+
+	self->is_lossy_region_damaged = false;
+	self->last_lossy_damage = gettime_us();
+
+	if (pixman_region32_not_empty(&self->lossy_region))
+		vnc_client_schedule_lossless_refresh(self,
+				self->lossless_refresh_delay);
 }
 
 void vnc_client_clear_av_frames(struct vnc_client* self)
@@ -96,14 +721,54 @@ void vnc_client_clear_av_frames(struct vnc_client* self)
 	self->n_av_frames = 0;
 }
 
+static void vnc_client_got_copy_rect(rfbClient* client, int src_x, int src_y,
+		int width, int height, int dst_x, int dst_y)
+{
+	struct vnc_client* self = rfbClientGetClientData(client, NULL);
+	assert(self);
+
+	vnc_client_resolve_stale(self, src_x, src_y, width, height);
+	self->got_copy_rect(client, src_x, src_y, width, height, dst_x, dst_y);
+	vnc_client_track_lossy_copy(self, src_x, src_y, width, height, dst_x,
+			dst_y);
+
+	/* The copy can only be repeated by the renderer if its source hasn't
+	 * been drawn to earlier in this update.
+	 */
+	if (!self->record_copy_rects || self->decode_scale != 1 ||
+			self->n_copy_rects >= VNC_CLIENT_MAX_COPY_RECTS ||
+			src_x < 0 || src_y < 0 ||
+			src_x + width > client->width ||
+			src_y + height > client->height ||
+			dst_x < 0 || dst_y < 0 ||
+			dst_x + width > client->width ||
+			dst_y + height > client->height ||
+			dirty_tiles_intersects(&self->damage, src_x, src_y,
+				width, height))
+		return;
+
+	self->copy_rects[self->n_copy_rects++] = (struct vnc_copy_rect) {
+		.src_x = src_x,
+		.src_y = src_y,
+		.dst_x = dst_x,
+		.dst_y = dst_y,
+		.width = width,
+		.height = height,
+	};
+
+	self->current_rect_is_copy = true;
+}
+
 static void vnc_client_start_update(rfbClient* client)
 {
 	struct vnc_client* self = rfbClientGetClientData(client, NULL);
 	assert(self);
 
 	self->pts = NO_PTS;
-	pixman_region_clear(&self->damage);
+	dirty_tiles_clear(&self->damage);
 	vnc_client_clear_av_frames(self);
+	self->n_copy_rects = 0;
+	vnc_client_prune_jpeg_rects(self);
 
 	self->is_updating = true;
 }
@@ -113,6 +778,9 @@ static void vnc_client_cancel_update(rfbClient* client)
 	struct vnc_client* self = rfbClientGetClientData(client, NULL);
 	assert(self);
 
+	vnc_client_complete_jpeg_rects(self);
+	vnc_client_reset_lossy_rect(self);
+
 	self->is_updating = false;
 }
 
@@ -123,8 +791,11 @@ static void vnc_client_finish_update(rfbClient* client)
 
 	DTRACE_PROBE2(wlvncc, vnc_client_finish_update, client, self->pts);
 
+	vnc_client_complete_jpeg_rects(self);
 	self->is_updating = false;
 
+	vnc_client_finish_lossy_tracking(self);
+
 	self->update_fb(self);
 }
 
@@ -174,6 +845,7 @@ static rfbBool vnc_client_handle_open_h264_rect(rfbClient* client,
 	f->y = rect_header->r.y;
 	f->width = rect_header->r.w;
 	f->height = rect_header->r.h;
+	vnc_client_reduce_rect(self, &f->x, &f->y, &f->width, &f->height);
 
 	self->av_frames[self->n_av_frames++] = f;
 
@@ -181,6 +853,187 @@ static rfbBool vnc_client_handle_open_h264_rect(rfbClient* client,
 	return true;
 }
 
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+static void vnc_client_submit_jpeg_rect(struct vnc_client* self,
+		struct vnc_jpeg_rect* rect)
+{
+	rect->job.data = rect->data;
+	rect->job.length = rect->length;
+	rect->job.width = rect->width;
+	rect->job.height = rect->height;
+	rect->is_pending = true;
+
+	pixman_region32_union_rect(&self->pending_region,
+			&self->pending_region, rect->x, rect->y, rect->width,
+			rect->height);
+
+	jpeg_pool_submit(&rect->job);
+}
+
+// Decodes straight into the framebuffer
+static void vnc_client_decode_rgb(struct vnc_client* self,
+		struct vnc_jpeg_rect* rect)
+{
+	rfbClient* client = self->client;
+	int stride = vnc_client_get_stride(self);
+
+	rect->job.dst = client->frameBuffer + rect->y * stride + rect->x * 4;
+	rect->job.pitch = stride;
+	rect->job.flags = vnc_client_tj_flags(client);
+
+	vnc_client_submit_jpeg_rect(self, rect);
+}
+
+static int vnc_client_decode_yuv(struct vnc_client* self,
+		struct vnc_jpeg_rect* rect)
+{
+	tjhandle tjhnd = vnc_client_get_tjhnd(self);
+	if (!tjhnd)
+		return -1;
+
+	int width, height, subsamp;
+	if (tjDecompressHeader2(tjhnd, rect->data, rect->length, &width,
+				&height, &subsamp) == -1)
+		return -1;
+
+	if (width != rect->width || height != rect->height ||
+			subsamp == TJSAMP_GRAY)
+		return -1;
+
+	for (int i = 0; i < 3; ++i) {
+		rect->plane_width[i] = tjPlaneWidth(i, width, subsamp);
+		rect->plane_height[i] = tjPlaneHeight(i, height, subsamp);
+		rect->strides[i] = rect->plane_width[i];
+		rect->planes[i] = malloc(rect->strides[i] *
+				rect->plane_height[i]);
+		if (!rect->planes[i])
+			goto failure;
+	}
+
+	rect->subsamp = subsamp;
+	rect->job.planes = rect->planes;
+	rect->job.strides = rect->strides;
+	self->yuv_rects[self->n_yuv_rects++] = rect;
+
+	vnc_client_submit_jpeg_rect(self, rect);
+	return 0;
+
+failure:
+	for (int i = 0; i < 3; ++i) {
+		free(rect->planes[i]);
+		rect->planes[i] = NULL;
+	}
+	return -1;
+}
+
+/* JPEG rects are decoded by the JPEG pool while the rest of the update is
+ * being read. Anything that touches their pixels before the update is
+ * finished waits for them in vnc_client_lock_area().
+ *
+ * If the renderer can take them, they are decoded into YUV planes, which
+ * leaves colour conversion and upsampling to the GPU. Should anything read
+ * the pixels from the framebuffer later on, they are decoded again on the CPU.
+ */
+static rfbBool vnc_client_got_jpeg(rfbClient* client, const uint8_t* buffer,
+		int length, int x, int y, int width, int height)
+{
+	struct vnc_client* self = rfbClientGetClientData(client, NULL);
+	assert(self);
+
+	struct vnc_jpeg_rect* rect = calloc(1, sizeof(*rect));
+	if (!rect)
+		return FALSE;
+
+	rect->data = malloc(length);
+	if (!rect->data) {
+		free(rect);
+		return FALSE;
+	}
+
+	memcpy(rect->data, buffer, length);
+	rect->length = length;
+	rect->x = x;
+	rect->y = y;
+	rect->width = width;
+	rect->height = height;
+
+	// Whatever was missing beneath the rect is drawn over now
+	vnc_client_refresh_stale(self, x, y, width, height);
+
+	wl_list_insert(self->jpeg_rects.prev, &rect->link);
+	self->n_jpeg_rects++;
+
+	if (!self->decode_yuv) {
+		pixman_region32_init(&rect->stale);
+		vnc_client_decode_rgb(self, rect);
+		return TRUE;
+	}
+
+	pixman_region32_init_rect(&rect->stale, x, y, width, height);
+	pixman_region32_union_rect(&self->stale_region, &self->stale_region,
+			x, y, width, height);
+
+	// Keep the number of compressed rects that are held on to bounded
+	if (self->n_jpeg_rects > VNC_CLIENT_MAX_JPEG_RECTS) {
+		struct vnc_jpeg_rect* oldest;
+		oldest = wl_container_of(self->jpeg_rects.next, oldest, link);
+		vnc_client_resolve_jpeg_rect(self, oldest);
+	}
+
+	self->current_rect_is_yuv = true;
+
+	if (self->n_yuv_rects < VNC_CLIENT_MAX_YUV_RECTS &&
+			vnc_client_decode_yuv(self, rect) == 0)
+		return TRUE;
+
+	return vnc_client_resolve_jpeg_rect(self, rect) == 0 ? TRUE : FALSE;
+}
+#endif
+
+static void vnc_client_lock_area(rfbClient* client, int x, int y, int width,
+		int height)
+{
+	struct vnc_client* self = rfbClientGetClientData(client, NULL);
+	assert(self);
+
+	struct pixman_box32 box = {
+		.x1 = x,
+		.y1 = y,
+		.x2 = x + width,
+		.y2 = y + height,
+	};
+
+	// Every rect locks its area before it is decoded
+	vnc_client_reset_lossy_rect(self);
+
+	if (pixman_region32_contains_rectangle(&self->pending_region, &box) !=
+			PIXMAN_REGION_OUT)
+		vnc_client_complete_jpeg_rects(self);
+}
+
+static void vnc_client_update_jpeg_hook(struct vnc_client* self)
+{
+	bool use_hook = false;
+
+	vnc_client_complete_jpeg_rects(self);
+
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+	rfbClient* client = self->client;
+	use_hook = self->decode_scale == 1 &&
+		client->format.bitsPerPixel == 32;
+	client->GotJpeg = use_hook ? vnc_client_got_jpeg : NULL;
+#endif
+
+	if (!use_hook || !self->decode_yuv)
+		vnc_client_resolve_all(self);
+}
+
+void vnc_client_set_decode_yuv(struct vnc_client* self, bool enable)
+{
+	self->decode_yuv = enable;
+	vnc_client_update_jpeg_hook(self);
+}
+
 static void vnc_client_init_open_h264(void)
 {
 	static int encodings[] = { RFB_ENCODING_OPEN_H264, 0 };
@@ -251,10 +1104,22 @@ struct vnc_client* vnc_client_create(struct data_control* data_control)
 	client->FinishedFrameBufferUpdate = vnc_client_finish_update;
 	client->StartingFrameBufferUpdate = vnc_client_start_update;
 	client->CancelledFrameBufferUpdate = vnc_client_cancel_update;
+	client->SoftCursorLockArea = vnc_client_lock_area;
 	client->GotXCutText = vnc_client_got_cut_text;
+	client->GotLossyRect = vnc_client_got_lossy_rect;
+	self->got_copy_rect = client->GotCopyRect;
+	client->GotCopyRect = vnc_client_got_copy_rect;
 	self->cut_text = cut_text;
 
+	pixman_region32_init(&self->lossy_region);
+	pixman_region32_init(&self->refine_region);
+	pixman_region32_init(&self->stale_region);
+	pixman_region32_init(&self->pending_region);
+	wl_list_init(&self->jpeg_rects);
+
 	self->pts = NO_PTS;
+	self->server_scale = 1;
+	self->decode_scale = 1;
 
 	// Handle authentication
 	client->GetCredential = handle_vnc_authentication;
@@ -298,6 +1163,22 @@ void cut_text (struct vnc_client* self, const char* text, size_t size) {
 
 void vnc_client_destroy(struct vnc_client* self)
 {
+	if (self->lossless_refresh_timer) {
+		aml_stop(aml_get_default(), self->lossless_refresh_timer);
+		aml_unref(self->lossless_refresh_timer);
+	}
+
+	pixman_region32_fini(&self->refine_region);
+	pixman_region32_fini(&self->lossy_region);
+	vnc_client_destroy_jpeg_rects(self);
+	pixman_region32_fini(&self->pending_region);
+	pixman_region32_fini(&self->stale_region);
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+	jpeg_pool_finish();
+	if (self->tjhnd)
+		tjDestroy(self->tjhnd);
+#endif
+	dirty_tiles_destroy(&self->damage);
 	vnc_client_clear_av_frames(self);
 	open_h264_destroy(self->open_h264);
 	rfbClientCleanup(self->client);
@@ -384,23 +1265,28 @@ int vnc_client_set_pixel_format(struct vnc_client* self, uint32_t format)
 	dst->bigEndian = FALSE;
 	self->client->appData.requestedDepth = dst->depth;
 
+	vnc_client_update_jpeg_hook(self);
+
 	return 0;
 }
 
 int vnc_client_get_width(const struct vnc_client* self)
 {
-	return self->client->width;
+	int k = self->decode_scale;
+	return (self->client->width + k - 1) / k;
 }
 
 int vnc_client_get_height(const struct vnc_client* self)
 {
-	return self->client->height;
+	int k = self->decode_scale;
+	return (self->client->height + k - 1) / k;
 }
 
 int vnc_client_get_stride(const struct vnc_client* self)
 {
 	// TODO: What happens if bitsPerPixel == 24?
-	return self->client->width * self->client->format.bitsPerPixel / 8;
+	return vnc_client_get_width(self) *
+		self->client->format.bitsPerPixel / 8;
 }
 
 void* vnc_client_get_fb(const struct vnc_client* self)
@@ -438,14 +1324,159 @@ int vnc_client_process(struct vnc_client* self)
 			break;
 	}
 
+	if (self->is_jpeg_failed) {
+		self->is_jpeg_failed = false;
+		rc = -1;
+	}
+
 	vnc_client_unlock_handler(self);
 	return rc;
 }
 
+void vnc_client_set_update_rect(struct vnc_client* self, int x, int y,
+		int width, int height)
+{
+	rfbClient* client = self->client;
+	int k = self->decode_scale;
+
+	x *= k;
+	y *= k;
+	width *= k;
+	height *= k;
+
+	struct pixman_region32 exposed;
+	pixman_region32_init_rect(&exposed, x, y, width, height);
+	pixman_region32_intersect_rect(&exposed, &exposed, 0, 0, client->width,
+			client->height);
+
+	struct pixman_box32* ext = pixman_region32_extents(&exposed);
+	if (ext->x1 == client->updateRect.x &&
+			ext->y1 == client->updateRect.y &&
+			ext->x2 - ext->x1 == client->updateRect.w &&
+			ext->y2 - ext->y1 == client->updateRect.h)
+		goto done;
+
+	bool is_initialised = client->updateRect.x >= 0;
+	struct pixman_region32 old;
+	pixman_region32_init_rect(&old, client->updateRect.x,
+			client->updateRect.y, client->updateRect.w,
+			client->updateRect.h);
+
+	client->updateRect.x = ext->x1;
+	client->updateRect.y = ext->y1;
+	client->updateRect.w = ext->x2 - ext->x1;
+	client->updateRect.h = ext->y2 - ext->y1;
+
+	/* The server doesn't tell us about changes outside of the update
+	 * rectangle, so anything that's newly covered by it is stale.
+	 */
+	pixman_region32_subtract(&exposed, &exposed, &old);
+	pixman_region32_fini(&old);
+
+	if (!is_initialised)
+		goto done;
+
+	int n_rects = 0;
+	struct pixman_box32* box = pixman_region32_rectangles(&exposed, &n_rects);
+
+	for (int i = 0; i < n_rects; ++i)
+		SendFramebufferUpdateRequest(client, box[i].x1, box[i].y1,
+				box[i].x2 - box[i].x1, box[i].y2 - box[i].y1,
+				FALSE);
+
+done:
+	pixman_region32_fini(&exposed);
+}
+
+int vnc_client_set_desktop_size(struct vnc_client* self, int width,
+		int height)
+{
+	rfbClient* client = self->client;
+
+	// The server must have told us about its screen layout first
+	if (client->screen.width == 0 && client->screen.height == 0)
+		return -1;
+
+	return SendExtDesktopSize(client, width, height) ? 0 : -1;
+}
+
+int vnc_client_set_server_scale(struct vnc_client* self, int scale)
+{
+	rfbClient* client = self->client;
+
+	if (!SupportsClient2Server(client, rfbSetScale) &&
+			!SupportsClient2Server(client, rfbPalmVNCSetScaleFactor))
+		return -1;
+
+	if (!SendScaleSetting(client, scale))
+		return -1;
+
+	self->server_scale = scale;
+	return 0;
+}
+
+void vnc_client_set_updates_paused(struct vnc_client* self, bool is_paused)
+{
+	rfbClient* client = self->client;
+
+	if (client->updatesPaused == is_paused)
+		return;
+
+	client->updatesPaused = is_paused;
+
+	if (is_paused || client->updateRect.x < 0)
+		return;
+
+	/* Nothing has been requested while paused, so everything that changed
+	 * in the meantime must be fetched again.
+	 */
+	SendFramebufferUpdateRequest(client, client->updateRect.x,
+			client->updateRect.y, client->updateRect.w,
+			client->updateRect.h, FALSE);
+}
+
+int vnc_client_set_decode_scale(struct vnc_client* self, int scale)
+{
+	rfbClient* client = self->client;
+
+	if (scale != 1 && scale != 2 && scale != 4 && scale != 8)
+		return -1;
+
+	// The downsampling hooks only deal with 32 bit pixels
+	if (client->format.bitsPerPixel != 32)
+		return -1;
+
+	self->decode_scale = scale;
+	client->frameBufferDownscale = scale;
+
+	if (scale > 1) {
+		client->GotBitmap = vnc_client_reduce_bitmap;
+		client->GotFillRect = vnc_client_reduce_fill;
+		self->got_copy_rect = vnc_client_reduce_copy;
+	}
+
+	vnc_client_update_jpeg_hook(self);
+
+	return 0;
+}
+
 void vnc_client_send_pointer_event(struct vnc_client* self, int x, int y,
 		uint32_t button_mask)
 {
-	SendPointerEvent(self->client, x, y, button_mask);
+	rfbClient* client = self->client;
+	int k = self->decode_scale;
+
+	// Aim for the middle of the block that a reduced pixel stands for
+	if (k > 1) {
+		x = x * k + k / 2;
+		y = y * k + k / 2;
+		if (x >= client->width)
+			x = client->width - 1;
+		if (y >= client->height)
+			y = client->height - 1;
+	}
+
+	SendPointerEvent(client, x, y, button_mask);
 }
 
 void vnc_client_send_keyboard_event(struct vnc_client* self, uint32_t symbol,
@@ -477,6 +1508,19 @@ void vnc_client_set_compression_level(struct vnc_client* self, int value)
 	self->client->appData.compressLevel = value;
 }
 
+void vnc_client_set_lossless_refresh_delay(struct vnc_client* self,
+		int delay_ms)
+{
+	self->lossless_refresh_delay =
+		delay_ms > 0 ? delay_ms * UINT64_C(1000) : 0;
+
+	if (!self->lossless_refresh_delay || self->lossless_refresh_timer)
+		return;
+
+	self->lossless_refresh_timer = aml_timer_new(self->lossless_refresh_delay,
+			on_lossless_refresh_timeout, self, NULL);
+}
+
 void vnc_client_send_cut_text(struct vnc_client* self, const char* text,
 		size_t len)
 {
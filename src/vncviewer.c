@@ -363,6 +363,9 @@ void rfbClientCleanup(rfbClient* client) {
   if (client->raw_buffer)
     free(client->raw_buffer);
 
+  free(client->stagingBuffer);
+  free(client->tightPrevRow);
+
   FreeTLS(client);
 
   while (client->clientData) {
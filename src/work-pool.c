@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "work-pool.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+struct work_item {
+	work_fn fn;
+	void* userdata;
+};
+
+/* One pool of threads is shared by everything that works in parallel. Jobs are
+ * run in the order they were submitted, and work_pool_wait() runs jobs on the
+ * calling thread until none are left.
+ */
+static struct {
+	pthread_t threads[WORK_POOL_MAX_THREADS];
+	int n_threads;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+
+	struct work_item* items;
+	int n_items, capacity;
+	int next;
+	int n_running;
+	bool is_stopping;
+} pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.start_cond = PTHREAD_COND_INITIALIZER,
+	.done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void* work_thread(void* arg)
+{
+	int worker = (intptr_t)arg;
+
+	pthread_mutex_lock(&pool.mutex);
+
+	for (;;) {
+		while (pool.next == pool.n_items && !pool.is_stopping)
+			pthread_cond_wait(&pool.start_cond, &pool.mutex);
+
+		if (pool.is_stopping)
+			break;
+
+		struct work_item item = pool.items[pool.next++];
+		pool.n_running++;
+
+		pthread_mutex_unlock(&pool.mutex);
+		item.fn(item.userdata, worker);
+		pthread_mutex_lock(&pool.mutex);
+
+		if (--pool.n_running == 0)
+			pthread_cond_signal(&pool.done_cond);
+	}
+
+	pthread_mutex_unlock(&pool.mutex);
+	return NULL;
+}
+
+int work_pool_init(void)
+{
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int n_threads = n_cpus > 1 ? n_cpus - 1 : 0;
+	if (n_threads > WORK_POOL_MAX_THREADS)
+		n_threads = WORK_POOL_MAX_THREADS;
+
+	// The calling thread takes its share while waiting
+	for (int i = 0; i < n_threads; ++i) {
+		if (pthread_create(&pool.threads[i], NULL, work_thread,
+					(void*)(intptr_t)(i + 1)) != 0)
+			break;
+		pool.n_threads++;
+	}
+
+	return 0;
+}
+
+void work_pool_finish(void)
+{
+	work_pool_wait();
+
+	pthread_mutex_lock(&pool.mutex);
+	pool.is_stopping = true;
+	pthread_cond_broadcast(&pool.start_cond);
+	pthread_mutex_unlock(&pool.mutex);
+
+	for (int i = 0; i < pool.n_threads; ++i)
+		pthread_join(pool.threads[i], NULL);
+
+	pool.n_threads = 0;
+	pool.is_stopping = false;
+
+	free(pool.items);
+	pool.items = NULL;
+	pool.capacity = 0;
+}
+
+int work_pool_get_n_threads(void)
+{
+	return pool.n_threads;
+}
+
+static int work_pool_reserve(int n)
+{
+	if (n <= pool.capacity)
+		return 0;
+
+	int capacity = pool.capacity ? pool.capacity * 2 : 64;
+	struct work_item* items = realloc(pool.items,
+			capacity * sizeof(*items));
+	if (!items)
+		return -1;
+
+	pool.items = items;
+	pool.capacity = capacity;
+	return 0;
+}
+
+void work_pool_submit(work_fn fn, void* userdata)
+{
+	if (pool.n_threads == 0)
+		goto run;
+
+	pthread_mutex_lock(&pool.mutex);
+
+	if (work_pool_reserve(pool.n_items + 1) < 0) {
+		pthread_mutex_unlock(&pool.mutex);
+		goto run;
+	}
+
+	pool.items[pool.n_items++] = (struct work_item) {
+		.fn = fn,
+		.userdata = userdata,
+	};
+	pthread_cond_signal(&pool.start_cond);
+	pthread_mutex_unlock(&pool.mutex);
+	return;
+
+run:
+	fn(userdata, 0);
+}
+
+void work_pool_wait(void)
+{
+	pthread_mutex_lock(&pool.mutex);
+
+	while (pool.next < pool.n_items) {
+		struct work_item item = pool.items[pool.next++];
+
+		pthread_mutex_unlock(&pool.mutex);
+		item.fn(item.userdata, 0);
+		pthread_mutex_lock(&pool.mutex);
+	}
+
+	while (pool.n_running > 0)
+		pthread_cond_wait(&pool.done_cond, &pool.mutex);
+
+	pool.n_items = 0;
+	pool.next = 0;
+
+	pthread_mutex_unlock(&pool.mutex);
+}